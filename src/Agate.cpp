@@ -1,3 +1,6 @@
+#include <algorithm>
+
+#include "fastmath.hpp"
 #include "plugin.hpp"
 #include "widgets.hpp"
 
@@ -8,10 +11,41 @@ struct Agate : echodalia::EDModule
 private:
   float _position;
   float _globalGateLength;
+  /* refreshed at control rate */
+  int _numVoices = 1;
+  /* refreshed when the pattern mode or length changes */
+  int _numSteps;
+  int _lengthScale;
+  /* processVoices() for the pattern mode */
+  uint32_t (Agate::*_processVoices)(bool isSnapshotDue, int& shownPage);
+  /* log2 of the steps in each pattern */
+  int _patternShift;
+  /* PATTERN voltages as last decoded, one channel per page */
+  float _patternVoltages[4][PORT_MAX_CHANNELS];
+  /* channels of each PATTERN input as last decoded; 0 forces a decode */
+  int _patternChannels[4] = {};
+  /* bank to switch to at the next step boundary */
+  int _pendingBank = 0;
+  /* step of the first voice on the previous sample */
+  int _lastStep = -1;
+
+  /*
+   * set the gates of every voice, with STRIDE patterns per output; returns
+   * the cells playing if isSnapshotDue
+   */
+  template<int STRIDE>
+  uint32_t processVoices(bool isSnapshotDue, int& shownPage);
 
 public:
   static const int PATTERNS_LEN = 4;
+  /* steps of all patterns together at the shortest length */
   static const int STEPS_MAX = 32;
+  /* steps per pattern shown at once on the panel */
+  static const int PAGE_LEN = 8;
+  static const int LENGTH_SCALE_MAX = 32;
+  static const int PATTERN_STEPS_MAX = PAGE_LEN * LENGTH_SCALE_MAX;
+  static const int BANK_WORDS_LEN = PATTERNS_LEN * PATTERN_STEPS_MAX / 64;
+  static const int BANKS_LEN = 64;
   enum ParamId
   {
     GATE_LENGTH_PARAM,
@@ -23,7 +57,8 @@ public:
     ADDRESS_INPUT,
     PATTERN_INPUT,
     GATE_LENGTH_INPUT = PATTERN_INPUT + PATTERNS_LEN,
-    INPUTS_LEN = GATE_LENGTH_INPUT + PATTERNS_LEN
+    BANK_INPUT = GATE_LENGTH_INPUT + PATTERNS_LEN,
+    INPUTS_LEN
   };
   enum OutputId
   {
@@ -40,15 +75,52 @@ public:
     TWO_CHANNELS,
     FOUR_CHANNELS
   };
-  uint8_t patterns[PATTERNS_LEN] = {0, 0, 0, 0};
+  /* state shown on the panel */
+  struct Snapshot
+  {
+    /* the page shown, one byte per pattern */
+    uint8_t patterns[PATTERNS_LEN];
+    /* bit 8i + k is set if any voice is on row k of pattern i */
+    uint32_t playingSteps;
+    int numChannels;
+    int page;
+  };
+  /* a change to one step of the active bank, made on the panel */
+  struct StepEdit
+  {
+    int pattern;
+    int step;
+    bool isOn;
+  };
+  /*
+   * step k of pattern i is bit i * PATTERN_STEPS_MAX + k of a bank. patterns
+   * have room for the longest length, so changing length never moves steps.
+   */
+  uint64_t banks[BANKS_LEN][BANK_WORDS_LEN] = {};
+  int bank = 0;
+  /* bank chosen in the context menu, used while BANK is unpatched */
+  int selectedBank = 0;
+  /* patterns are PAGE_LEN * lengthScale steps; a power of 2 */
+  int lengthScale = 1;
+  /* page shown on the panel, or -1 to follow the first voice */
+  int displayPage = -1;
   PatternMode patternMode;
   bool isMuteWhenZero = true;
+  echodalia::SnapshotBuffer<Snapshot> snapshots;
+  /* pushed by the widget only and applied by process(), which owns steps */
+  dsp::RingBuffer<StepEdit, 64> stepEdits;
 
   Agate();
   void process(const ProcessArgs& args) override;
   float getGlobalGateLength();
   int getNumChannels();
   float getPosition();
+  bool getStep(int ptrn, int step);
+  void setStep(int ptrn, int step, bool isOn);
+  uint8_t getPage(int ptrn, int page);
+  void setPage(int ptrn, int page, uint8_t steps);
+  void switchBank(int newBank);
+  void setLayout(PatternMode mode, int scale);
   void setGlobalGateLength(float);
   void setPosition(float);
   json_t* dataToJson() override;
@@ -74,37 +146,180 @@ Agate::Agate()
     configInput(GATE_LENGTH_INPUT + i, ptrn_name + " gate length");
     configOutput(GATE_OUTPUT + i, ptrn_name + " gate");
   }
+  configInput(BANK_INPUT, "Pattern bank (0-10 V over 64 banks)");
+  setLayout(FOUR_CHANNELS, 1);
 }
 
 void
 Agate::process(const ProcessArgs& args)
 {
+  if (stepEdits.empty() && processSteady()) {
+    return;
+  }
+  while (!stepEdits.empty()) {
+    StepEdit edit = stepEdits.shift();
+    setStep(edit.pattern, edit.step, edit.isOn);
+  }
+
+  Input& address = getInput(ADDRESS_INPUT);
+  // switch banks once the first voice reaches a new step, or straight away
+  // if nothing is driving the playhead
+  if (_pendingBank != bank) {
+    int step = echodalia::fastmath::posmod(address.getVoltage() / 10, 1.f) *
+               _numSteps;
+    if (!isInputConnected(ADDRESS_INPUT) || step != _lastStep) {
+      switchBank(_pendingBank);
+    }
+  }
+
+  // channel k of a PATTERN input sets page k of its pattern
   for (int i = 0; i < PATTERNS_LEN; i++) {
-    Input p = getInput(PATTERN_INPUT + i);
-    if (p.isConnected()) {
-      patterns[i] = (uint8_t)math::clamp(
-        std::round((p.getVoltage() / 10.0) * 256.0), 0.f, 255.f);
+    Input& input = getInput(PATTERN_INPUT + i);
+    int channels = input.getChannels();
+    bool is_stale = channels != _patternChannels[i];
+    _patternChannels[i] = channels;
+    for (int c = 0; c < channels; c += 4) {
+      // only decode channels whose voltage moved
+      simd::float_4 v = input.getVoltageSimd<simd::float_4>(c);
+      int changed =
+        is_stale
+          ? 0xf
+          : simd::movemask(v != simd::float_4::load(&_patternVoltages[i][c]));
+      if (!changed) {
+        continue;
+      }
+      v.store(&_patternVoltages[i][c]);
+      // rounds halves up, as std::round did for the non-negative range
+      simd::int32_4 pages = simd::int32_4(
+        simd::clamp(simd::floor(v / 10.f * 256.f + 0.5f), 0.f, 255.f));
+      for (int k = 0; k < 4 && c + k < channels; k++) {
+        if ((changed >> k) & 1) {
+          setPage(i, c + k, pages[k]);
+        }
+      }
     }
   }
-  patternMode = (PatternMode)getParam(PATTERN_MODE_PARAM).getValue();
-  setPosition(getInput(ADDRESS_INPUT).getVoltage() / 10);
-  setGlobalGateLength(getParam(GATE_LENGTH_PARAM).getValue());
-
-  int num_steps = STEPS_MAX / getNumChannels();
-  int cur_step = getPosition() * num_steps;
-  float step_length = 1.0 / num_steps;
-
-  // prevent triggers being sent while position is exactly 0 (i.e., while the
-  // phasor driving the sequencer is stopped)
-  bool maybe_high =
-    (!isMuteWhenZero || (getPosition() > 0.f)) &&
-    (std::fmod((getPosition() / step_length), 1.0) <= getGlobalGateLength());
-
-  for (int i = 0; i < PATTERNS_LEN; i += (num_steps / 8)) {
-    int ptrn_id = i + (cur_step / 8);
-    bool is_high = maybe_high && ((patterns[ptrn_id] >> (cur_step % 8)) % 2);
-    getOutput(GATE_OUTPUT + i).setVoltage(10 * is_high);
+  if (processControlRate()) {
+    PatternMode mode =
+      (PatternMode)getParam(PATTERN_MODE_PARAM).getValue();
+    if (mode != patternMode || lengthScale != _lengthScale) {
+      setLayout(mode, lengthScale);
+    }
+    setGlobalGateLength(getParam(GATE_LENGTH_PARAM).getValue());
+    Input& bank_input = getInput(BANK_INPUT);
+    _pendingBank =
+      isInputConnected(BANK_INPUT)
+        ? math::clamp(
+            (int)(bank_input.getVoltage() / 10 * BANKS_LEN), 0, BANKS_LEN - 1)
+        : math::clamp(selectedBank, 0, BANKS_LEN - 1);
+    // one playhead per ADDRESS channel, all reading the same patterns
+    _numVoices = std::max(address.getChannels(), 1);
+    for (int i = 0; i < PATTERNS_LEN; i++) {
+      setOutputChannels(GATE_OUTPUT + i, _numVoices);
+    }
   }
+
+  bool is_snapshot_due = processSnapshotRate();
+  int shown_page = 0;
+  uint32_t playing_steps =
+    (this->*_processVoices)(is_snapshot_due, shown_page);
+
+  if (is_snapshot_due) {
+    Snapshot& snapshot = snapshots.getWriteSlot();
+    for (int i = 0; i < PATTERNS_LEN; i++) {
+      snapshot.patterns[i] = getPage(i, shown_page);
+    }
+    snapshot.playingSteps = playing_steps;
+    snapshot.numChannels = getNumChannels();
+    snapshot.page = shown_page;
+    snapshots.publish();
+  }
+
+  // each voice's gates follow from its ADDRESS voltage alone, so they only
+  // change when an input or param does
+  setSteady(true);
+}
+
+template<int STRIDE>
+uint32_t
+Agate::processVoices(bool isSnapshotDue, int& shownPage)
+{
+  Input& address = getInput(ADDRESS_INPUT);
+  int num_steps = _numSteps;
+  int pattern_mask = (1 << _patternShift) - 1;
+  const uint64_t* words = banks[bank];
+
+  uint32_t playing_steps = 0;
+  for (int c = 0; c < _numVoices; c += 4) {
+    simd::float_4 position = echodalia::fastmath::posmod(
+      address.getPolyVoltageSimd<simd::float_4>(c) / 10.f, 1.f);
+    simd::float_4 steps = position * num_steps;
+    int32_t cur_steps[4];
+    simd::int32_4(steps).store(cur_steps);
+    if (!c) {
+      setPosition(position[0]);
+      _lastStep = cur_steps[0];
+      shownPage = (displayPage < 0)
+                    ? (cur_steps[0] & pattern_mask) / PAGE_LEN
+                    : std::min(displayPage, _lengthScale - 1);
+    }
+
+    simd::float_4 step_phase = echodalia::fastmath::posmod(steps, 1.f);
+    simd::float_4 maybe_high = FLOAT_4_MASK;
+    if (isMuteWhenZero) {
+      // prevent triggers being sent while position is exactly 0 (i.e., while
+      // the phasor driving the sequencer is stopped)
+      maybe_high = position > FLOAT_4_ZERO;
+    }
+
+    // gate length of each pattern for these voices; the knob stands in for
+    // unpatched inputs
+    simd::float_4 gate_lengths[PATTERNS_LEN];
+    for (int i = 0; i < PATTERNS_LEN; i++) {
+      Input& input = getInput(GATE_LENGTH_INPUT + i);
+      gate_lengths[i] =
+        isInputConnected(GATE_LENGTH_INPUT + i)
+          ? simd::clamp(
+              input.getPolyVoltageSimd<simd::float_4>(c) / 10.f, 0.f, 1.f)
+          : simd::float_4(getGlobalGateLength());
+    }
+
+    // output i plays patterns i to i + STRIDE - 1 in turn; each step is a
+    // word index and a shift, however long the patterns are
+    for (int i = 0; i < PATTERNS_LEN; i += STRIDE) {
+      // outputs without a cable are only followed for the panel
+      bool is_connected = isOutputConnected(GATE_OUTPUT + i);
+      if (!(is_connected || isSnapshotDue)) {
+        continue;
+      }
+      float is_set_fl[4];
+      float gate_length_fl[4];
+      for (int k = 0; k < 4; k++) {
+        int ptrn = i + (cur_steps[k] >> _patternShift);
+        int row = cur_steps[k] & pattern_mask;
+        int bit = ptrn * PATTERN_STEPS_MAX + row;
+        is_set_fl[k] = (words[bit / 64] >> (bit % 64)) & 1;
+        gate_length_fl[k] = gate_lengths[ptrn][k];
+
+        if (isSnapshotDue && c + k < _numVoices &&
+            row / PAGE_LEN == shownPage) {
+          playing_steps |= 1u << (ptrn * PAGE_LEN + row % PAGE_LEN);
+        }
+      }
+      if (!is_connected) {
+        continue;
+      }
+      simd::float_4 is_set = simd::float_4::load(is_set_fl) > FLOAT_4_ZERO;
+      // one compare for all four voices against their patterns' lengths
+      simd::float_4 is_high =
+        step_phase <= simd::float_4::load(gate_length_fl);
+      simd::float_4 gate =
+        simd::ifelse(is_set & is_high & maybe_high, 10.f, FLOAT_4_ZERO);
+      getOutput(GATE_OUTPUT + i).setVoltageSimd(gate, c);
+    }
+  }
+
+  return playing_steps;
 }
 
 json_t*
@@ -113,29 +328,89 @@ Agate::dataToJson()
   json_t* root = json_object();
   json_t* ptrns = json_array();
   for (int i = 0; i < PATTERNS_LEN; i++) {
-    json_array_append_new(ptrns, json_integer(patterns[i]));
+    json_array_append_new(ptrns, json_integer(getPage(i, 0)));
   }
   json_object_set_new(root, "patterns", ptrns);
   json_object_set_new(root, "isMuteWhenZero", json_integer(isMuteWhenZero));
+
+  // banks as little-endian words in base64, leaving out trailing empty words
+  const int words_len = BANKS_LEN * BANK_WORDS_LEN;
+  std::vector<uint8_t> bytes(words_len * 8);
+  size_t bytes_len = 0;
+  for (int w = 0; w < words_len; w++) {
+    uint64_t word = banks[w / BANK_WORDS_LEN][w % BANK_WORDS_LEN];
+    for (int k = 0; k < 8; k++) {
+      bytes[w * 8 + k] = word >> (8 * k);
+    }
+    if (word) {
+      bytes_len = (w + 1) * 8;
+    }
+  }
+  json_object_set_new(
+    root,
+    "banks",
+    json_string(string::toBase64(bytes.data(), bytes_len).c_str()));
+  json_object_set_new(root, "bank", json_integer(bank));
+  json_object_set_new(root, "selectedBank", json_integer(selectedBank));
+  json_object_set_new(root, "lengthScale", json_integer(lengthScale));
+  json_object_set_new(root, "displayPage", json_integer(displayPage));
   return echodalia::EDModule::dataToJson(root);
 }
 
 void
 Agate::dataFromJson(json_t* root)
 {
-  json_t* val = json_object_get(root, "patterns");
-  json_t* ptrn;
-  if (json_is_array(val)) {
-    for (size_t i = 0; (i < json_array_size(val)) && (i < PATTERNS_LEN); i++) {
-      ptrn = json_array_get(val, i);
-      if (json_is_integer(ptrn)) {
-        patterns[i] = json_integer_value(ptrn);
-      }
+  json_t* val = json_object_get(root, "isMuteWhenZero");
+  if (json_is_integer(val)) {
+    isMuteWhenZero = json_integer_value(val);
+  }
+
+  val = json_object_get(root, "selectedBank");
+  if (json_is_integer(val)) {
+    selectedBank = math::clamp((int)json_integer_value(val), 0, BANKS_LEN - 1);
+  }
+  val = json_object_get(root, "bank");
+  bank = json_is_integer(val)
+           ? math::clamp((int)json_integer_value(val), 0, BANKS_LEN - 1)
+           : 0;
+  _pendingBank = bank;
+  val = json_object_get(root, "lengthScale");
+  if (json_is_integer(val)) {
+    int scale = json_integer_value(val);
+    lengthScale = 1;
+    while (lengthScale < scale && lengthScale < LENGTH_SCALE_MAX) {
+      lengthScale *= 2;
     }
   }
-  val = json_object_get(root, "isMuteWhenZero");
+  val = json_object_get(root, "displayPage");
   if (json_is_integer(val)) {
-    isMuteWhenZero = json_integer_value(val);
+    displayPage = json_integer_value(val);
+  }
+
+  val = json_object_get(root, "banks");
+  if (json_is_string(val)) {
+    std::vector<uint8_t> bytes = string::fromBase64(json_string_value(val));
+    for (int w = 0; w < BANKS_LEN * BANK_WORDS_LEN; w++) {
+      uint64_t word = 0;
+      for (int k = 0; k < 8 && (size_t)(w * 8 + k) < bytes.size(); k++) {
+        word |= (uint64_t)bytes[w * 8 + k] << (8 * k);
+      }
+      banks[w / BANK_WORDS_LEN][w % BANK_WORDS_LEN] = word;
+    }
+  } else {
+    // patches from before banks hold only the first page of each pattern
+    std::fill(&banks[0][0], &banks[0][0] + BANKS_LEN * BANK_WORDS_LEN, 0);
+    val = json_object_get(root, "patterns");
+    json_t* ptrn;
+    if (json_is_array(val)) {
+      for (size_t i = 0; (i < json_array_size(val)) && (i < PATTERNS_LEN);
+           i++) {
+        ptrn = json_array_get(val, i);
+        if (json_is_integer(ptrn)) {
+          setPage(i, 0, json_integer_value(ptrn));
+        }
+      }
+    }
   }
   echodalia::EDModule::dataFromJson(root);
 }
@@ -155,6 +430,77 @@ Agate::getNumChannels()
   return 1;
 }
 
+/* steps of the active bank */
+bool
+Agate::getStep(int ptrn, int step)
+{
+  int bit = ptrn * PATTERN_STEPS_MAX + step;
+  return (banks[bank][bit / 64] >> (bit % 64)) & 1;
+}
+
+void
+Agate::setStep(int ptrn, int step, bool isOn)
+{
+  int bit = ptrn * PATTERN_STEPS_MAX + step;
+  uint64_t mask = (uint64_t)1 << (bit % 64);
+  if (isOn) {
+    banks[bank][bit / 64] |= mask;
+  } else {
+    banks[bank][bit / 64] &= ~mask;
+  }
+}
+
+/* PAGE_LEN steps of a pattern of the active bank, the first in bit 0 */
+uint8_t
+Agate::getPage(int ptrn, int page)
+{
+  int bit = ptrn * PATTERN_STEPS_MAX + page * PAGE_LEN;
+  return banks[bank][bit / 64] >> (bit % 64);
+}
+
+void
+Agate::setPage(int ptrn, int page, uint8_t steps)
+{
+  int bit = ptrn * PATTERN_STEPS_MAX + page * PAGE_LEN;
+  uint64_t& word = banks[bank][bit / 64];
+  word = (word & ~((uint64_t)0xff << (bit % 64))) |
+         ((uint64_t)steps << (bit % 64));
+}
+
+/* constant-time: banks are only reindexed */
+void
+Agate::switchBank(int newBank)
+{
+  bank = newBank;
+  // patched PATTERN inputs take over again from the new bank
+  std::fill(_patternChannels, _patternChannels + PATTERNS_LEN, 0);
+}
+
+void
+Agate::setLayout(PatternMode mode, int scale)
+{
+  patternMode = mode;
+  _lengthScale = scale;
+  _patternShift = 0;
+  while ((1 << _patternShift) < PAGE_LEN * scale) {
+    _patternShift++;
+  }
+  // patterns played by each output, i.e. the spacing of the outputs in use
+  int stride = PATTERNS_LEN / getNumChannels();
+  _numSteps = stride << _patternShift;
+  switch (stride) {
+    case 1:
+      _processVoices = &Agate::processVoices<1>;
+      break;
+    case 2:
+      _processVoices = &Agate::processVoices<2>;
+      break;
+    default:
+      _processVoices = &Agate::processVoices<4>;
+      break;
+  }
+}
+
 float
 Agate::getPosition()
 {
@@ -165,7 +511,7 @@ void
 Agate::setPosition(float v)
 {
   // keep position within 0-1 range (mimic python modulus)
-  _position = std::fmod(std::fmod(v, 1.0) + 1.0, 1.0);
+  _position = echodalia::fastmath::posmod(v, 1.f);
 }
 
 float
@@ -183,10 +529,14 @@ Agate::setGlobalGateLength(float v)
 struct AgateWidget : echodalia::EDModuleWidget
 {
 private:
-  uint8_t _columns[Agate::PATTERNS_LEN];
-  int _currentStep;
+  uint8_t _columns[Agate::PATTERNS_LEN] = {};
+  uint32_t _playingSteps;
   int _numChannels;
+  /* page of the patterns on the panel, which clicks edit */
+  int _page = 0;
   int _currentTouchAction = 0;
+  /* so dragging over a cell queues its edit once */
+  Agate::StepEdit _lastEdit = { -1, -1, false };
 
 public:
   enum TouchAction
@@ -198,6 +548,8 @@ public:
   echodalia::DotMatrixGridDisplay* dotMatrix;
   FramebufferWidget* fb;
   AgateWidget(Agate* agate);
+  bool isCellOverridden(Agate* agate, int col);
+  void editCell(Agate* agate, int col, int row, bool isOn);
   void step() override;
   void appendContextMenu(Menu* menu) override;
 };
@@ -227,20 +579,18 @@ AgateWidget::AgateWidget(Agate* agate)
     if (!agate) {
       return;
     }
+    _lastEdit.pattern = -1;
     if (col < 0 || row < 0) {
       // clicked margin or space between cells
       _currentTouchAction = NONE;
+    } else if (isCellOverridden(agate, col)) {
+      // no point toggling cell that will be immediately reverted
+      _currentTouchAction = NONE;
     } else {
-      Port input = agate->getInput(Agate::PATTERN_INPUT + col);
-      if (input.isConnected()) {
-        // no point toggling cell that will be immediately reverted
-        _currentTouchAction = NONE;
-      } else {
-        // toggle cell under cursor
-        agate->patterns[col] ^= 1 << row;
-        _currentTouchAction =
-          ((agate->patterns[col] >> row) % 2) ? DRAW : ERASE;
-      }
+      // toggle cell under cursor
+      bool is_on = !((_columns[col] >> row) & 1);
+      editCell(agate, col, row, is_on);
+      _currentTouchAction = is_on ? DRAW : ERASE;
     }
   };
 
@@ -251,21 +601,21 @@ AgateWidget::AgateWidget(Agate* agate)
         return;
       }
       if (col >= 0 && row >= 0) {
-        Port input = agate->getInput(Agate::PATTERN_INPUT + col);
-        if (input.isConnected()) {
+        if (isCellOverridden(agate, col)) {
           return;
         }
         switch (_currentTouchAction) {
-          case NONE:
-            agate->patterns[col] ^= 1 << row;
-            _currentTouchAction =
-              ((agate->patterns[col] >> row) % 2) ? DRAW : ERASE;
+          case NONE: {
+            bool is_on = !((_columns[col] >> row) & 1);
+            editCell(agate, col, row, is_on);
+            _currentTouchAction = is_on ? DRAW : ERASE;
             break;
+          }
           case DRAW:
-            agate->patterns[col] |= 1 << row;
+            editCell(agate, col, row, true);
             break;
           case ERASE:
-            agate->patterns[col] &= ~((char)(1 << row));
+            editCell(agate, col, row, false);
             break;
         }
       }
@@ -280,6 +630,8 @@ AgateWidget::AgateWidget(Agate* agate)
 
   addInput(createInputCentered<PJ301MPort>(
     mm2px(Vec(7.62, 21.4167)), agate, Agate::ADDRESS_INPUT));
+  addInput(createInputCentered<PJ301MPort>(
+    mm2px(Vec(40.64, 10.0)), agate, Agate::BANK_INPUT));
   addParam(createParamCentered<RoundBlackKnob>(
     mm2px(Vec(22.86, 19.27503)), agate, Agate::GATE_LENGTH_PARAM));
   addParam(createParamCentered<CKSSThree>(
@@ -295,6 +647,30 @@ AgateWidget::AgateWidget(Agate* agate)
   }
 }
 
+/* true if a PATTERN channel sets the page shown of column col */
+bool
+AgateWidget::isCellOverridden(Agate* agate, int col)
+{
+  return agate->getInput(Agate::PATTERN_INPUT + col).getChannels() > _page;
+}
+
+/*
+ * queue an edit of a cell on the page shown. edits are dropped while the
+ * queue is full, i.e. while the engine isn't running.
+ */
+void
+AgateWidget::editCell(Agate* agate, int col, int row, bool isOn)
+{
+  Agate::StepEdit edit = { col, _page * Agate::PAGE_LEN + row, isOn };
+  if ((edit.pattern == _lastEdit.pattern && edit.step == _lastEdit.step &&
+       edit.isOn == _lastEdit.isOn) ||
+      agate->stepEdits.full()) {
+    return;
+  }
+  agate->stepEdits.push(edit);
+  _lastEdit = edit;
+}
+
 void
 AgateWidget::step()
 {
@@ -304,28 +680,37 @@ AgateWidget::step()
     return;
   }
 
-  int num_channels = agate->getNumChannels();
-  int num_steps = Agate::STEPS_MAX / num_channels;
-  int cur_step = agate->getPosition() * num_steps;
+  const Agate::Snapshot& snapshot = agate->snapshots.read();
+  int num_channels = snapshot.numChannels;
+  if (!num_channels) {
+    // nothing published yet
+    echodalia::EDModuleWidget::step();
+    return;
+  }
+  uint32_t playing_steps = snapshot.playingSteps;
+  // the framebuffer caches the pattern only; the playhead is drawn on top of
+  // it every frame
   bool is_dirty =
-    ((num_channels != _numChannels) || (cur_step != _currentStep));
+    ((num_channels != _numChannels) || (snapshot.page != _page));
+  bool is_playing_changed = playing_steps != _playingSteps;
 
   for (int i = 0, ptrn = 0; i < Agate::PATTERNS_LEN; i++) {
-    ptrn = agate->patterns[i];
-    is_dirty = is_dirty || (_columns[i] != ptrn);
-    if (is_dirty) {
+    ptrn = snapshot.patterns[i];
+    bool is_column_changed = is_dirty || (_columns[i] != ptrn);
+    is_dirty = is_dirty || is_column_changed;
+    if (is_column_changed || is_playing_changed) {
       for (int k = 0; k < 8; k++) {
-        // this works as long as num_channels is 1, 2, or 4
-        int step = (((i * 8) % num_steps) + k);
-        bool is_cur_step = (cur_step == step);
-        dotMatrix->cells[{ i, k }] =
-          // set/unset ENABLED and PLAYING
+        bool is_cur_step = (playing_steps >> (i * Agate::PAGE_LEN + k)) & 1;
+        // set/unset ENABLED and PLAYING
+        dotMatrix->setCell(
+          i,
+          k,
           (echodalia::DotMatrixGridDisplay::CellState)((ptrn % 2) |
-                                                       (is_cur_step * 2));
+                                                       (is_cur_step * 2)));
         ptrn >>= 1;
       }
     }
-    _columns[i] = agate->patterns[i];
+    _columns[i] = snapshot.patterns[i];
   }
 
   dotMatrix->columnDividers = (num_channels == 4)   ? 0b111
@@ -333,7 +718,8 @@ AgateWidget::step()
                                                     : 0;
 
   _numChannels = num_channels;
-  _currentStep = cur_step;
+  _playingSteps = playing_steps;
+  _page = snapshot.page;
 
   fb->dirty = is_dirty;
   echodalia::EDModuleWidget::step();
@@ -345,6 +731,40 @@ AgateWidget::appendContextMenu(Menu* menu)
   menu->addChild(new MenuSeparator);
   menu->addChild(createBoolPtrMenuItem(
     "Mute while ADDR is 0 V", "", &agate->isMuteWhenZero));
+  std::vector<std::string> bank_names;
+  for (int b = 0; b < Agate::BANKS_LEN; b++) {
+    bank_names.push_back(std::to_string(b + 1));
+  }
+  menu->addChild(createIndexPtrSubmenuItem(
+    "Pattern bank (while BANK is unpatched)",
+    bank_names,
+    &agate->selectedBank));
+  std::vector<std::string> length_names;
+  for (int scale = 1; scale <= Agate::LENGTH_SCALE_MAX; scale *= 2) {
+    length_names.push_back("x" + std::to_string(scale) + " (" +
+                           std::to_string(scale * Agate::PAGE_LEN) +
+                           " steps per pattern)");
+  }
+  menu->addChild(createIndexSubmenuItem(
+    "Sequence length",
+    length_names,
+    [=]() {
+      int index = 0;
+      while ((1 << index) < agate->lengthScale) {
+        index++;
+      }
+      return index;
+    },
+    [=](size_t index) { agate->lengthScale = 1 << index; }));
+  std::vector<std::string> page_names = { "Follow first voice" };
+  for (int page = 0; page < agate->lengthScale; page++) {
+    page_names.push_back("Page " + std::to_string(page + 1));
+  }
+  menu->addChild(createIndexSubmenuItem(
+    "Page shown",
+    page_names,
+    [=]() { return std::min(agate->displayPage, agate->lengthScale - 1) + 1; },
+    [=](size_t index) { agate->displayPage = (int)index - 1; }));
   echodalia::EDModuleWidget::appendContextMenu(menu);
 }
 
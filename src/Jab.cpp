@@ -1,38 +1,50 @@
+#include "gates.hpp"
 #include "plugin.hpp"
 #include "widgets.hpp"
 #include <algorithm>
+#include <cctype>
 #include <string>
 using namespace rack;
 
-struct Jab : echodalia::EDModule
+/*
+ * LANES independent gate lanes, each with its own gate input, buttons and six
+ * outputs. gates and latches are kept as one 16-bit word per lane, bit c for
+ * channel c, so that edges and latches are a few integer ops per lane.
+ */
+template<int LANES>
+struct JabModule : echodalia::EDModule
 {
 protected:
   // dsp::SchmittTrigger inputTrigger;
-  dsp::TSchmittTrigger<simd::float_4> inputTriggers[4];
+  /* Schmitt trigger states, high at first like dsp::TSchmittTrigger's */
+  uint16_t inputStates[LANES];
   // unsigned int gateState[16] = { 0 };
   // unsigned int lastGateState[16] = { 0 };
-  simd::float_4 lastGates[4];
-  simd::float_4 latches[4];
-  simd::float_4 gateStartPulses[4];
-  simd::float_4 gateEndPulses[4];
-  dsp::BooleanTrigger resetButtonTrigger;
+  uint16_t lastGates[LANES] = {};
+  uint16_t latches[LANES] = {};
+  /* time left of each channel's pulse, and the channels still pulsing */
+  float gateStartPulses[LANES][16] = {};
+  float gateEndPulses[LANES][16] = {};
+  uint16_t startPulsing[LANES] = {};
+  uint16_t endPulsing[LANES] = {};
+  dsp::BooleanTrigger resetButtonTriggers[LANES];
   // dsp::BooleanTrigger combinedGateTrigger;
   // dsp::PulseGenerator gateStartPulse;
   // dsp::PulseGenerator gateEndPulse;
-  dsp::ClockDivider lightDivider;
 
 public:
   enum ParamId
   {
     GATE_PARAM,
-    RESET_PARAM,
-    PARAMS_LEN
+    RESET_PARAM = GATE_PARAM + LANES,
+    PARAMS_LEN = RESET_PARAM + LANES
   };
   enum InputId
   {
     GATE_INPUT,
-    INPUTS_LEN
+    INPUTS_LEN = GATE_INPUT + LANES
   };
+  /* outputs of the first lane; lane n's follow at n * LANE_OUTPUTS_LEN */
   enum OutputId
   {
     MOMENTARY_OUTPUT,
@@ -41,7 +53,8 @@ public:
     NOT_LATCH_OUTPUT,
     START_OUTPUT,
     END_OUTPUT,
-    OUTPUTS_LEN
+    LANE_OUTPUTS_LEN,
+    OUTPUTS_LEN = LANE_OUTPUTS_LEN * LANES
   };
   /* LightId order must correspond with OutputId */
   enum LightId
@@ -52,7 +65,8 @@ public:
     NOT_LATCH_LIGHT,
     START_LIGHT,
     END_LIGHT,
-    LIGHTS_LEN
+    LANE_LIGHTS_LEN,
+    LIGHTS_LEN = LANE_LIGHTS_LEN * LANES
   };
   enum GateSource
   {
@@ -70,144 +84,251 @@ public:
   GateSource gateSource = INPUT_IF_CONNECTED_ELSE_BUTTON;
   float lightFadeoutLambda = 15.f;
   int numChannels = 0;
+  /* refreshed at control rate, per lane */
+  int activeChannels[LANES];
+  int activeBlocks[LANES];
+  GateSource activeGateSources[LANES];
+  uint16_t gateButtonMasks[LANES];
 
-  Jab()
+  JabModule()
   {
     config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
-    configSwitch(GATE_PARAM, 0, 1, 0, "Gate", { "Off", "On" });
-    configButton(RESET_PARAM, "Reset latches");
-    configInput(GATE_INPUT, "Gate");
-    configOutput(MOMENTARY_OUTPUT, "Momentary gate");
-    configOutput(NOT_MOMENTARY_OUTPUT, "Inverted momentary gate");
-    configOutput(LATCH_OUTPUT, "Latch gate");
-    configOutput(NOT_LATCH_OUTPUT, "Inverted latch gate");
-    configOutput(START_OUTPUT, "Low-to-high trigger");
-    configOutput(END_OUTPUT, "High-to-low trigger");
-    // configOutput(START_OR_END_OUTPUT, "Momentary high/low trigger");
-    lightDivider.setDivision(8);
+    for (int lane = 0; lane < LANES; lane++) {
+      int o = lane * LANE_OUTPUTS_LEN;
+      configSwitch(
+        GATE_PARAM + lane, 0, 1, 0, getLaneName(lane, "Gate"), { "Off", "On" });
+      configButton(RESET_PARAM + lane, getLaneName(lane, "Reset latches"));
+      configInput(GATE_INPUT + lane, getLaneName(lane, "Gate"));
+      configOutput(o + MOMENTARY_OUTPUT, getLaneName(lane, "Momentary gate"));
+      configOutput(o + NOT_MOMENTARY_OUTPUT,
+                   getLaneName(lane, "Inverted momentary gate"));
+      configOutput(o + LATCH_OUTPUT, getLaneName(lane, "Latch gate"));
+      configOutput(o + NOT_LATCH_OUTPUT,
+                   getLaneName(lane, "Inverted latch gate"));
+      configOutput(o + START_OUTPUT, getLaneName(lane, "Low-to-high trigger"));
+      configOutput(o + END_OUTPUT, getLaneName(lane, "High-to-low trigger"));
+      // configOutput(START_OR_END_OUTPUT, "Momentary high/low trigger");
 
-    for (int i = 0; i < 4; i++) {
-      lastGates[i] = FLOAT_4_ZERO;
-      latches[i] = FLOAT_4_ZERO;
-      gateStartPulses[i] = FLOAT_4_ZERO;
-      gateEndPulses[i] = FLOAT_4_ZERO;
+      activeChannels[lane] = 1;
+      activeBlocks[lane] = 1;
+      activeGateSources[lane] = BUTTON_ONLY;
+      laneKernels[lane] = getLaneKernel(BUTTON_ONLY, 1);
+      gateButtonMasks[lane] = 0;
+      inputStates[lane] = 0xffff;
     }
   }
 
+  /* name is prefixed with the lane number when there is more than one */
+  static std::string getLaneName(int lane, std::string name)
+  {
+    if (LANES == 1) {
+      return name;
+    }
+    name[0] = std::tolower(name[0]);
+    return "Lane " + std::to_string(lane + 1) + " " + name;
+  }
+
+  /*
+   * processLane() for a gate kernel set, gate source and number of 4-channel
+   * blocks, so that none of them is branched on per sample
+   */
+  typedef void (JabModule::*LaneKernel)(int lane,
+                                        float sampleTime,
+                                        bool isControlFrame);
+  LaneKernel laneKernels[LANES];
+
+  template<typename KERNELS, GateSource SOURCE, int BLOCKS>
+  inline __attribute__((always_inline)) void processLane(int lane,
+                                                         float sampleTime,
+                                                         bool isControlFrame);
+  template<GateSource SOURCE, int BLOCKS>
+  void processLaneSse(int lane, float sampleTime, bool isControlFrame)
+  {
+    processLane<echodalia::gates::Sse, SOURCE, BLOCKS>(
+      lane, sampleTime, isControlFrame);
+  }
+#ifdef ECHODALIA_AVX2
+  /* the whole lane is built for AVX2, so that the Avx2 kernels inline */
+  template<GateSource SOURCE, int BLOCKS>
+  ECHODALIA_AVX2 void processLaneAvx2(int lane,
+                                      float sampleTime,
+                                      bool isControlFrame)
+  {
+    processLane<echodalia::gates::Avx2, SOURCE, BLOCKS>(
+      lane, sampleTime, isControlFrame);
+  }
+#endif
+  template<GateSource SOURCE, int BLOCKS>
+  static LaneKernel getLaneKernel();
+  template<GateSource SOURCE>
+  static LaneKernel getLaneKernel(int blocks);
+  static LaneKernel getLaneKernel(GateSource source, int blocks);
   void process(const ProcessArgs& args) override;
   json_t* dataToJson() override;
   void dataFromJson(json_t* root) override;
 };
 
+typedef JabModule<1> Jab;
+typedef JabModule<4> JabQuad;
+
+template<int LANES>
 void
-Jab::process(const ProcessArgs& args)
+JabModule<LANES>::process(const ProcessArgs& args)
 {
-  rack::Port gate_input = getInput(GATE_INPUT);
-  int num_channels =
-    numChannels ? numChannels : std::max(gate_input.getChannels(), 1);
-  int channels_div4 = ((num_channels - 1) / 4) + 1;
-  for (int i = 0; i < OUTPUTS_LEN; i++) {
-    getOutput(i).setChannels(num_channels);
-  }
+  bool is_control_frame = processControlRate();
 
-  if (resetButtonTrigger.process(getParam(RESET_PARAM).getValue())) {
-    for (int i = 0; i < 4; i++) {
-      latches[i] = FLOAT_4_ZERO;
-    }
-  }
+  if (is_control_frame) {
+    for (int lane = 0; lane < LANES; lane++) {
+      rack::Port& gate_input = getInput(GATE_INPUT + lane);
+      activeChannels[lane] =
+        numChannels ? numChannels : std::max(gate_input.getChannels(), 1);
+      for (int k = 0; k < LANE_OUTPUTS_LEN; k++) {
+        setOutputChannels(lane * LANE_OUTPUTS_LEN + k, activeChannels[lane]);
+      }
 
-  simd::float_4 gate_button_mask =
-    (getParam(GATE_PARAM).getValue()) ? FLOAT_4_MASK : FLOAT_4_ZERO;
-  simd::float_4 gates[4];
+      if (resetButtonTriggers[lane].process(
+            getParam(RESET_PARAM + lane).getValue())) {
+        latches[lane] = 0;
+      }
 
-  GateSource gate_source = gateSource;
-  if (gate_source == INPUT_IF_CONNECTED_ELSE_BUTTON) {
-    if (gate_input.isConnected()) {
-      gate_source = INPUT_ONLY;
-    } else {
-      gate_source = BUTTON_ONLY;
-    }
-  }
+      gateButtonMasks[lane] =
+        (getParam(GATE_PARAM + lane).getValue()) ? 0xffff : 0;
 
-  switch (gate_source) {
-    case BUTTON_ONLY:
-      for (int i = 0; i < 4; i++) {
-        gates[i] = gate_button_mask;
-      }
-      break;
-    case INPUT_ONLY:
-      for (int i = 0; i < 4; i++) {
-        inputTriggers[i].process(
-          gate_input.getVoltageSimd<simd::float_4>(i * 4));
-        gates[i] = inputTriggers[i].isHigh();
-      }
-      break;
-    case BUTTON_AND_INPUT:
-      for (int i = 0; i < 4; i++) {
-        // gates[i] = gates[i] && gate_button.getValue();
-        inputTriggers[i].process(
-          gate_input.getVoltageSimd<simd::float_4>(i * 4));
-        gates[i] = gate_button_mask & inputTriggers[i].isHigh();
+      GateSource source = gateSource;
+      if (source == INPUT_IF_CONNECTED_ELSE_BUTTON) {
+        if (isInputConnected(GATE_INPUT + lane)) {
+          source = INPUT_ONLY;
+        } else {
+          source = BUTTON_ONLY;
+        }
       }
-      break;
-    case BUTTON_OR_INPUT:
-      for (int i = 0; i < 4; i++) {
-        inputTriggers[i].process(
-          gate_input.getVoltageSimd<simd::float_4>(i * 4));
-        gates[i] = gate_button_mask | inputTriggers[i].isHigh();
+      int blocks = ((activeChannels[lane] - 1) / 4) + 1;
+      if (source != activeGateSources[lane] || blocks != activeBlocks[lane]) {
+        activeGateSources[lane] = source;
+        activeBlocks[lane] = blocks;
+        laneKernels[lane] = getLaneKernel(source, blocks);
       }
-      break;
-    default:
-      break;
+    }
+  }
+
+  for (int lane = 0; lane < LANES; lane++) {
+    (this->*laneKernels[lane])(lane, args.sampleTime, is_control_frame);
   }
+}
 
-  simd::float_4 voltages[OUTPUTS_LEN];
-  for (int i = 0, i4 = 0; i < 4; i++, i4 += 4) {
-    gateStartPulses[i] = simd::ifelse(
-      simd::andnot(lastGates[i], gates[i]),
-      pulseLength,
-      simd::fmax(FLOAT_4_ZERO, gateStartPulses[i] - args.sampleTime));
-    gateEndPulses[i] = simd::ifelse(
-      simd::andnot(gates[i], lastGates[i]),
-      pulseLength,
-      simd::fmax(FLOAT_4_ZERO, gateEndPulses[i] - args.sampleTime));
-    latches[i] = simd::ifelse(
-      simd::andnot(lastGates[i], gates[i]), ~latches[i], latches[i]);
+template<int LANES>
+template<typename KERNELS,
+         typename JabModule<LANES>::GateSource SOURCE,
+         int BLOCKS>
+inline void
+JabModule<LANES>::processLane(int lane, float sampleTime, bool isControlFrame)
+{
+  uint16_t gates = gateButtonMasks[lane];
+  if (SOURCE != BUTTON_ONLY) {
+    inputStates[lane] = KERNELS::schmitt(
+      getInput(GATE_INPUT + lane).getVoltages(), inputStates[lane], BLOCKS);
+    uint16_t input_gates = inputStates[lane] & ((1 << (BLOCKS * 4)) - 1);
+    gates = (SOURCE == INPUT_ONLY)         ? input_gates
+            : (SOURCE == BUTTON_AND_INPUT) ? (gates & input_gates)
+                                           : (gates | input_gates);
+  }
 
-    if (i < channels_div4) {
-      voltages[START_OUTPUT] = simd::ifelse(
-        gateStartPulses[i] > FLOAT_4_ZERO, highVoltageOut, lowVoltageOut);
-      voltages[END_OUTPUT] = simd::ifelse(
-        gateEndPulses[i] > FLOAT_4_ZERO, highVoltageOut, lowVoltageOut);
-      voltages[LATCH_OUTPUT] =
-        simd::ifelse(latches[i], highVoltageOut, lowVoltageOut);
-      voltages[NOT_LATCH_OUTPUT] =
-        simd::ifelse(latches[i], lowVoltageOut, highVoltageOut);
-      voltages[MOMENTARY_OUTPUT] =
-        simd::ifelse(gates[i], highVoltageOut, lowVoltageOut);
-      voltages[NOT_MOMENTARY_OUTPUT] =
-        simd::ifelse(gates[i], lowVoltageOut, highVoltageOut);
+  uint16_t rises = gates & ~lastGates[lane];
+  uint16_t falls = lastGates[lane] & ~gates;
+  // with no edges and no triggers counting down, the lane's outputs stay as
+  // last written until the next control frame rewrites them
+  if (!(rises | falls | startPulsing[lane] | endPulsing[lane]) &&
+      !isControlFrame) {
+    return;
+  }
+  latches[lane] ^= rises;
+  lastGates[lane] = gates;
+  startPulsing[lane] = KERNELS::processPulses(
+    gateStartPulses[lane], rises, startPulsing[lane], pulseLength, sampleTime);
+  endPulsing[lane] = KERNELS::processPulses(
+    gateEndPulses[lane], falls, endPulsing[lane], pulseLength, sampleTime);
 
-      for (int k = 0; k < OUTPUTS_LEN; k++) {
-        getOutput(k).setVoltageSimd(voltages[k], i4);
-      }
+  // the channels each output is high on
+  uint16_t highs[LANE_OUTPUTS_LEN];
+  highs[MOMENTARY_OUTPUT] = gates;
+  highs[NOT_MOMENTARY_OUTPUT] = ~gates;
+  highs[LATCH_OUTPUT] = latches[lane];
+  highs[NOT_LATCH_OUTPUT] = ~latches[lane];
+  highs[START_OUTPUT] = startPulsing[lane];
+  highs[END_OUTPUT] = endPulsing[lane];
 
-      if (!i && lightDivider.process()) {
-        for (int k = 0; k < OUTPUTS_LEN && k < LIGHTS_LEN; k++) {
-          getLight(k).setBrightnessSmooth(voltages[k][0] > 0,
-                                          args.sampleTime *
-                                            lightDivider.getDivision(),
-                                          lightFadeoutLambda);
-        }
-      }
+  // only outputs with a cable are expanded from the masks
+  int connected = connectedOutputs >> (lane * LANE_OUTPUTS_LEN);
+  for (int k = 0; k < LANE_OUTPUTS_LEN; k++) {
+    if (!((connected >> k) & 1)) {
+      continue;
     }
+    KERNELS::expand(
+      getOutput(lane * LANE_OUTPUTS_LEN + k).getVoltages(),
+      highs[k],
+      highVoltageOut[0],
+      lowVoltageOut[0],
+      BLOCKS);
+  }
 
-    lastGates[i] = gates[i];
+  if (isControlFrame) {
+    for (int k = 0; k < LANE_OUTPUTS_LEN && k < LANE_LIGHTS_LEN; k++) {
+      getLight(lane * LANE_LIGHTS_LEN + k)
+        .setBrightnessSmooth(
+          highs[k] & 1, controlSampleTime, lightFadeoutLambda);
+    }
   }
 }
 
+template<int LANES>
+template<typename JabModule<LANES>::GateSource SOURCE, int BLOCKS>
+typename JabModule<LANES>::LaneKernel
+JabModule<LANES>::getLaneKernel()
+{
+#ifdef ECHODALIA_AVX2
+  if (echodalia::gates::hasAvx2) {
+    return &JabModule::processLaneAvx2<SOURCE, BLOCKS>;
+  }
+#endif
+  return &JabModule::processLaneSse<SOURCE, BLOCKS>;
+}
+
+template<int LANES>
+template<typename JabModule<LANES>::GateSource SOURCE>
+typename JabModule<LANES>::LaneKernel
+JabModule<LANES>::getLaneKernel(int blocks)
+{
+  switch (blocks) {
+    case 1:
+      return getLaneKernel<SOURCE, 1>();
+    case 2:
+      return getLaneKernel<SOURCE, 2>();
+    case 3:
+      return getLaneKernel<SOURCE, 3>();
+    default:
+      return getLaneKernel<SOURCE, 4>();
+  }
+}
+
+template<int LANES>
+typename JabModule<LANES>::LaneKernel
+JabModule<LANES>::getLaneKernel(GateSource source, int blocks)
+{
+  switch (source) {
+    case INPUT_ONLY:
+      return getLaneKernel<INPUT_ONLY>(blocks);
+    case BUTTON_AND_INPUT:
+      return getLaneKernel<BUTTON_AND_INPUT>(blocks);
+    case BUTTON_OR_INPUT:
+      return getLaneKernel<BUTTON_OR_INPUT>(blocks);
+    default:
+      return getLaneKernel<BUTTON_ONLY>(blocks);
+  }
+}
+
+template<int LANES>
 json_t*
-Jab::dataToJson()
+JabModule<LANES>::dataToJson()
 {
   json_t* root = json_object();
   json_object_set_new(root, "numChannels", json_integer(numChannels));
@@ -215,8 +336,9 @@ Jab::dataToJson()
   return echodalia::EDModule::dataToJson(root);
 }
 
+template<int LANES>
 void
-Jab::dataFromJson(json_t* root)
+JabModule<LANES>::dataFromJson(json_t* root)
 {
   json_t* val = json_object_get(root, "numChannels");
   if (val) {
@@ -229,41 +351,54 @@ Jab::dataFromJson(json_t* root)
   echodalia::EDModule::dataFromJson(root);
 }
 
-struct JabWidget : echodalia::EDModuleWidget
+/* one Jab column per lane, each 3 HP wide */
+template<int LANES>
+struct JabModuleWidget : echodalia::EDModuleWidget
 {
-  JabWidget(Jab* jab)
+  JabModuleWidget(JabModule<LANES>* jab)
   {
     constexpr float XG = 2.54;
     constexpr float YG = 2.141666667;
     int i;
-    float x = 3 * XG;
     float y;
 
     setModule(jab);
     echodalia::EDPanel* panel = createPanel<echodalia::EDPanel>(
-      asset::plugin(pluginInstance, "res/panels/Jab.svg"));
+      asset::plugin(pluginInstance,
+                    (LANES == 1) ? "res/panels/Jab.svg"
+                                 : "res/panels/JabQuad.svg"));
     setPanel(panel);
     addChild(createWidget<ScrewBlack>(Vec(0, 0)));
     addChild(createWidget<ScrewSilver>(
-      Vec(2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - 15)));
+      Vec((3 * LANES - 1) * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - 15)));
 
-    addParam(
-      createParamCentered<CKD6>(mm2px(Vec(x, 8 * YG)), jab, Jab::GATE_PARAM));
-    addInput(createInputCentered<PJ301MPort>(
-      mm2px(Vec(x, 13 * YG)), jab, Jab::GATE_INPUT));
-    addParam(createParamCentered<VCVButton>(
-      mm2px(Vec(x, 18 * YG)), jab, Jab::RESET_PARAM));
+    for (int lane = 0; lane < LANES; lane++) {
+      float x0 = lane * 6 * XG;
+      float x = x0 + 3 * XG;
+      addParam(createParamCentered<CKD6>(
+        mm2px(Vec(x, 8 * YG)), jab, JabModule<LANES>::GATE_PARAM + lane));
+      addInput(createInputCentered<PJ301MPort>(
+        mm2px(Vec(x, 13 * YG)), jab, JabModule<LANES>::GATE_INPUT + lane));
+      addParam(createParamCentered<VCVButton>(
+        mm2px(Vec(x, 18 * YG)), jab, JabModule<LANES>::RESET_PARAM + lane));
 
-    for (i = 0, y = 25 * YG; i < Jab::OUTPUTS_LEN; i++, y += 6 * YG) {
-      addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(x, y)), jab, i));
-      addChild(createLightCentered<SmallLight<RedLight>>(
-        mm2px(Vec(XG, y + (2 * YG))), jab, i));
+      for (i = 0, y = 25 * YG; i < JabModule<LANES>::LANE_OUTPUTS_LEN;
+           i++, y += 6 * YG) {
+        addOutput(createOutputCentered<PJ301MPort>(
+          mm2px(Vec(x, y)),
+          jab,
+          lane * JabModule<LANES>::LANE_OUTPUTS_LEN + i));
+        addChild(createLightCentered<SmallLight<RedLight>>(
+          mm2px(Vec(x0 + XG, y + (2 * YG))),
+          jab,
+          lane * JabModule<LANES>::LANE_LIGHTS_LEN + i));
+      }
     }
   }
 
   void appendContextMenu(Menu* menu) override
   {
-    Jab* jab = getModule<Jab>();
+    JabModule<LANES>* jab = getModule<JabModule<LANES>>();
     menu->addChild(new MenuSeparator);
     menu->addChild(createIndexPtrSubmenuItem("Gate source",
                                              { "CV if connected, else button",
@@ -295,4 +430,5 @@ struct JabWidget : echodalia::EDModuleWidget
   }
 };
 
-Model* modelJab = createModel<Jab, JabWidget>("Jab");
+Model* modelJab = createModel<Jab, JabModuleWidget<1>>("Jab");
+Model* modelJabQuad = createModel<JabQuad, JabModuleWidget<4>>("JabQuad");
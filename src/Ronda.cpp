@@ -1,8 +1,11 @@
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
 #include <stdexcept>
 #include <string>
 
 #include "RondaEx.hpp"
+#include "fastmath.hpp"
 #include "plugin.hpp"
 #include "widgets.hpp"
 
@@ -12,14 +15,87 @@ struct Ronda : echodalia::EDModule
 {
 
 protected:
-  /* phasors before phase offset is applied */
-  double phasors[4];
+  /*
+   * phasors before phase offset is applied, indexed by phasor and channel.
+   * these stay in double, as the increments of slow phasors are too small to
+   * add to a float.
+   */
+  double phasors[4][PORT_MAX_CHANNELS];
+  /*
+   * fixed-point engine state, indexed by phasor and channel. one cycle is
+   * 2^64, so phasors wrap by integer overflow. increments are a per-voice unit
+   * times each phasor's ratio in units of 1 / RATIO_DENOM, which is divisible
+   * by every denominator up to 16; ratio-locked phasors therefore advance by
+   * exact integer multiples of one another and never drift apart.
+   */
+  uint64_t phaseAccs[4][PORT_MAX_CHANNELS];
+  /*
+   * the increments, refreshed at control rate so that each sample only adds
+   * integers, and the snapped ratios with the ratios they came from
+   */
+  uint64_t fixedIncs[4][PORT_MAX_CHANNELS];
+  uint64_t fixedRatios[4][PORT_MAX_CHANNELS];
+  float fixedRatioSources[4][PORT_MAX_CHANNELS];
   // dsp::ClockDivider debugDivider;
 
+  /*
+   * frames rendered ahead while no input modulates the phasors, so the only
+   * voice can be replayed without per-sample work. lanes are phasors rather
+   * than channels. each frame keeps the state reached after it, so that
+   * replay can stop at any frame.
+   */
+  static const int LOOKAHEAD_LEN = 64;
+  simd::float_4 lookaheadPhases[LOOKAHEAD_LEN];
+  simd::float_4 lookaheadClocks[LOOKAHEAD_LEN];
+  double lookaheadPhasors[LOOKAHEAD_LEN][4];
+  simd::float_4 lookaheadPulses[LOOKAHEAD_LEN];
+  uint64_t lookaheadAccs[LOOKAHEAD_LEN][4];
+  /* frames rendered, or 0 if there is nothing to replay */
+  int lookaheadLen = 0;
+  /* frames replayed */
+  int lookaheadPos = 0;
+  bool lookaheadRun = false;
+  bool isLookaheadEnabled = false;
+  echodalia::ExpanderMessagePair<RondaRangeMessage> rangeMessages;
+  echodalia::ExpanderMessagePair<RondaBusMessage> busMessages;
+  /* true while a RondaEx is on the right; set in onExpanderChange */
+  bool isExpanderPaired = false;
+  /* true while the RondaEx of another pair is on the left */
+  bool isChained = false;
+  /* the range the outputs were last scaled to, as RondaEx is not an input */
+  simd::float_4 lastMinV = FLOAT_4_ZERO;
+  simd::float_4 lastMaxV = FLOAT_4_ZERO;
+
+  void advanceFloat(int i,
+                    int channel,
+                    simd::float_4 delta,
+                    simd::float_4 ratio,
+                    simd::float_4 restart,
+                    simd::float_4& phsr,
+                    simd::float_4& wrap);
+  void updateFixedIncrements();
+  void advanceFixed(int i,
+                    int channel,
+                    bool run,
+                    simd::float_4 restart,
+                    simd::float_4& phsr,
+                    simd::float_4& wrap);
+  void convertEngineState();
+  void renderLookahead(float sampleTime, bool run);
+  void flushLookahead();
+
 public:
   static const int PHASORS_LEN = 4;
   static constexpr float MAX_FREQ_BASE = 8.f;
   static constexpr float MAX_VOUT = 10.f;
+  /* lcm(1, 2, ..., 16) * 64 */
+  static const uint64_t RATIO_DENOM = 720720 * 64;
+  enum Engine
+  {
+    FLOAT_ENGINE,
+    FIXED_ENGINE,
+    ENGINES_LEN
+  };
   enum ParamId
   {
     RESET_PARAM,
@@ -50,69 +126,85 @@ public:
   {
     LIGHTS_LEN
   };
-  dsp::ClockDivider lightDivider;
   dsp::SchmittTrigger runTrigger;
   dsp::SchmittTrigger resetTrigger;
-  dsp::SchmittTrigger syncTriggers[PHASORS_LEN];
-  dsp::PulseGenerator clockPulses[PHASORS_LEN];
+  dsp::TSchmittTrigger<simd::float_4> syncTriggers[PHASORS_LEN][4];
+  /* remaining time of each clock pulse, in seconds */
+  simd::float_4 clockPulses[PHASORS_LEN][4];
   bool isOutputPoly;
-
-  float getFreqBase()
+  float pulseLength = 1e-3f;
+  int numChannels = 1;
+  /* phase increment per sample at the base frequency, before FREQ CV */
+  echodalia::ControlSmoother<float> freqDeltaKnob;
+  echodalia::ControlSmoother<simd::float_4> rateKnobs;
+  echodalia::ControlSmoother<simd::float_4> phaseKnobs;
+  /* state shown on the panel */
+  struct Snapshot
   {
-    ParamQuantity* pq = getParamQuantity(FREQ_PARAM);
-    if (pq) {
-      return pq->getDisplayValue();
-    } else {
-      return 0;
-    }
-  }
-
-  float getFreqCV()
+    /* first voice, before scaling */
+    float phases[PHASORS_LEN];
+  };
+  echodalia::SnapshotBuffer<Snapshot> snapshots;
+  Engine engine = FLOAT_ENGINE;
+  /* engine whose state is current; switches are carried over in process() */
+  Engine activeEngine = FLOAT_ENGINE;
+
+  /*
+   * the number of voices follows the widest of the FREQ, RATE, PHASE and SYNC
+   * inputs
+   */
+  int getNumChannels()
   {
-    return std::pow(2, getInput(FREQ_INPUT).getNormalVoltage(0.f));
+    int num_channels = getInput(FREQ_INPUT).getChannels();
+    for (int i = 0; i < PHASORS_LEN; i++) {
+      num_channels =
+        std::max({ num_channels,
+                   getInput(SYNC1_INPUT + i).getChannels(),
+                   getInput(RATE1_INPUT + i).getChannels(),
+                   getInput(PHASE1_INPUT + i).getChannels() });
+    }
+    return std::max(num_channels, 1);
   }
 
-  float getFreqMain()
+  /* frequency multipliers for the 4 channels starting at channel */
+  simd::float_4 getFreqCV(int channel = 0)
   {
-    float f = getParamQuantity(FREQ_PARAM)->getDisplayValue();
-    float v = getInput(FREQ_INPUT).getNormalVoltage(0.f);
-    float freq = f * std::pow(2, v);
-    return freq;
+    Input& input = getInput(FREQ_INPUT);
+    return echodalia::fastmath::exp2(
+      input.getNormalPolyVoltageSimd<simd::float_4>(0.f, channel));
   }
 
-  double getPhasor(int i, bool safe = true)
+  double getPhasor(int i, int channel = 0, bool safe = true)
   {
-    if (safe && i >= PHASORS_LEN) {
+    if (safe && (i >= PHASORS_LEN || channel >= PORT_MAX_CHANNELS)) {
       throw std::out_of_range("out of range");
     }
-    return phasors[i];
-  }
-
-  float getFreqRatio(int i)
-  {
-    bool is_conn;
-    float ratio =
-      getInputOrParamVal(RATE1_INPUT + i, RATE1_PARAM + i, is_conn, true);
-    if (is_conn) {
-      ratio = std::pow(32.0, math::clamp(ratio, -5.0, 5.0) / 5.0);
+    if (activeEngine == FIXED_ENGINE) {
+      return phaseAccs[i][channel] * std::ldexp(1.0, -64);
     }
-
-    return ratio;
+    return phasors[i][channel];
   }
 
-  simd::float_4 getFreqRatio()
+  /* frequency ratios of phasor i for the 4 channels starting at channel */
+  simd::float_4 getFreqRatio(int i, int channel)
   {
-    simd::float_4 ratio = getParamVal4(RATE1_PARAM, true);
-
-    return ratio;
+    Input& input = getInput(RATE1_INPUT + i);
+    if (!input.isConnected()) {
+      return rateKnobs.value[i];
+    }
+    simd::float_4 v = input.getPolyVoltageSimd<simd::float_4>(channel);
+    // 32^(v / 5) == 2^v
+    return echodalia::fastmath::exp2(simd::clamp(v, -5.f, 5.f));
   }
 
-  simd::float_4 getPhase()
+  /* phase offsets of phasor i for the 4 channels starting at channel */
+  simd::float_4 getPhase(int i, int channel)
   {
-    int is_conn;
-    simd::float_4 phase =
-      getInputOrParamVal4(PHASE1_INPUT, PHASE1_PARAM, is_conn, true);
-    return phase;
+    Input& input = getInput(PHASE1_INPUT + i);
+    if (!input.isConnected()) {
+      return phaseKnobs.value[i];
+    }
+    return input.getPolyVoltageSimd<simd::float_4>(channel);
   }
 
   bool isRunning()
@@ -162,97 +254,514 @@ public:
                   0.f);
       configOutput(PHSR1_OUTPUT + i, phsr_name);
       configOutput(CLK1_OUTPUT + i, phsr_name + " clock");
+      for (int k = 0; k < 4; k++) {
+        clockPulses[i][k] = FLOAT_4_ZERO;
+      }
+      for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
+        phasors[i][c] = 0;
+        phaseAccs[i][c] = 0;
+        fixedIncs[i][c] = 0;
+        fixedRatios[i][c] = 0;
+        fixedRatioSources[i][c] = 0.f;
+      }
+    }
+
+    rangeMessages.attach(getRightExpander());
+    busMessages.attach(getLeftExpander());
+  }
+
+  /* true if any input besides RUN and RESET affects the phasors */
+  bool isModulated()
+  {
+    uint64_t run_and_reset =
+      ((uint64_t)1 << RUN_INPUT) | ((uint64_t)1 << RESET_INPUT);
+    return connectedInputs & ~run_and_reset;
+  }
+
+  void onExpanderChange(const ExpanderChangeEvent& e) override
+  {
+    Module* neighbour = getExpander(e.side).module;
+    bool is_expander = neighbour && neighbour->getModel() == modelRondaEx;
+    if (e.side) {
+      isExpanderPaired = is_expander;
+    } else {
+      isChained = is_expander;
     }
   }
 
+  void onPortChange(const PortChangeEvent& e) override
+  {
+    echodalia::EDModule::onPortChange(e);
+    // leave the fast path until the next control frame rechecks the inputs
+    flushLookahead();
+    isLookaheadEnabled = false;
+    isControlRefreshDue = true;
+  }
+
   void process(const ProcessArgs& args) override;
-  // json_t* dataToJson() override;
-  // void dataFromJson(json_t* root) override;
+  json_t* dataToJson() override;
+  void dataFromJson(json_t* root) override;
 };
 
+/*
+ * express a frequency ratio in units of 1 / Ronda::RATIO_DENOM, snapping to
+ * p / q for any q up to 16 if the ratio is within rounding error of it
+ */
+static uint64_t
+ratioToFixed(float ratio)
+{
+  for (int q = 1; q <= 16; q++) {
+    float p = std::round(ratio * q);
+    if (p > 0.f && std::fabs(ratio * q - p) <= p * 1e-5f) {
+      return (uint64_t)p * (Ronda::RATIO_DENOM / q);
+    }
+  }
+  return (uint64_t)std::llround((double)ratio * Ronda::RATIO_DENOM);
+}
+
+/*
+ * advance the 4 phasors at from by delta * ratio into to, in double lanes.
+ * they wrap by subtracting the integer part, so rates above the sample rate
+ * stay in range, and lanes in restart go to 0. returns the phasors as floats
+ * and sets wrap where one passed 1.
+ */
+static simd::float_4
+advancePhasors(const double* from,
+               double* to,
+               simd::float_4 delta,
+               simd::float_4 ratio,
+               simd::float_4 restart,
+               simd::float_4& wrap)
+{
+  const __m128d one = _mm_set1_pd(1.0);
+  // lanes 0 and 1 of each float_4, then lanes 2 and 3
+  __m128d inc_lo = _mm_mul_pd(_mm_cvtps_pd(delta.v), _mm_cvtps_pd(ratio.v));
+  __m128d inc_hi = _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(delta.v, delta.v)),
+                              _mm_cvtps_pd(_mm_movehl_ps(ratio.v, ratio.v)));
+  __m128d acc_lo = _mm_add_pd(_mm_loadu_pd(from), inc_lo);
+  __m128d acc_hi = _mm_add_pd(_mm_loadu_pd(from + 2), inc_hi);
+  __m128 wrap_lo = _mm_castpd_ps(_mm_cmpge_pd(acc_lo, one));
+  __m128 wrap_hi = _mm_castpd_ps(_mm_cmpge_pd(acc_hi, one));
+  acc_lo = _mm_sub_pd(acc_lo, _mm_floor_pd(acc_lo));
+  acc_hi = _mm_sub_pd(acc_hi, _mm_floor_pd(acc_hi));
+
+  // widen the restart mask to 64 bits per lane and clear the bits of a
+  // restarted double, which leaves 0.0
+  simd::float_4 lo = simd::ifelse(
+    simd::float_4(_mm_unpacklo_ps(restart.v, restart.v)),
+    FLOAT_4_ZERO,
+    simd::float_4(_mm_castpd_ps(acc_lo)));
+  simd::float_4 hi = simd::ifelse(
+    simd::float_4(_mm_unpackhi_ps(restart.v, restart.v)),
+    FLOAT_4_ZERO,
+    simd::float_4(_mm_castpd_ps(acc_hi)));
+  acc_lo = _mm_castps_pd(lo.v);
+  acc_hi = _mm_castps_pd(hi.v);
+  _mm_storeu_pd(to, acc_lo);
+  _mm_storeu_pd(to + 2, acc_hi);
+
+  // the low half of each 64-bit mask is a float mask
+  wrap =
+    simd::float_4(_mm_shuffle_ps(wrap_lo, wrap_hi, _MM_SHUFFLE(2, 0, 2, 0)));
+  return simd::float_4(
+    _mm_movelh_ps(_mm_cvtpd_ps(acc_lo), _mm_cvtpd_ps(acc_hi)));
+}
+
 void
-Ronda::process(const ProcessArgs& args)
+Ronda::advanceFloat(int i,
+                    int channel,
+                    simd::float_4 delta,
+                    simd::float_4 ratio,
+                    simd::float_4 restart,
+                    simd::float_4& phsr,
+                    simd::float_4& wrap)
 {
-  bool run = isRunning();
-  bool reset = isResetting();
-  float phsr_fl[4];
-  float clk_fl[4];
-  EDModule* expander = dynamic_cast<EDModule*>(getRightExpander().module);
-  bool is_expander = (expander && (expander->getModel() == modelRondaEx));
+  double* phsrs = phasors[i] + channel;
+  phsr = advancePhasors(phsrs, phsrs, delta, ratio, restart, wrap);
+}
 
-  if (reset) {
+/*
+ * add the increments at incs to the 4 accumulators at from and write them to
+ * to. phasors wrap by overflow, which sets wrap, and lanes in restart go to 0.
+ * returns the phasors as floats.
+ */
+static simd::float_4
+advanceAccs(const uint64_t* from,
+            uint64_t* to,
+            const uint64_t* incs,
+            simd::float_4 restart,
+            simd::float_4& wrap)
+{
+  // flipping the sign bits makes the signed compare an unsigned one
+  const __m128i sign = _mm_set1_epi64x(INT64_MIN);
+  __m128i old_lo = _mm_loadu_si128((const __m128i*)from);
+  __m128i old_hi = _mm_loadu_si128((const __m128i*)(from + 2));
+  __m128i acc_lo =
+    _mm_add_epi64(old_lo, _mm_loadu_si128((const __m128i*)incs));
+  __m128i acc_hi =
+    _mm_add_epi64(old_hi, _mm_loadu_si128((const __m128i*)(incs + 2)));
+  // an accumulator that overflowed ends up below where it started
+  __m128 wrap_lo = _mm_castsi128_ps(_mm_cmpgt_epi64(
+    _mm_xor_si128(old_lo, sign), _mm_xor_si128(acc_lo, sign)));
+  __m128 wrap_hi = _mm_castsi128_ps(_mm_cmpgt_epi64(
+    _mm_xor_si128(old_hi, sign), _mm_xor_si128(acc_hi, sign)));
+
+  // as in advancePhasors, restarted lanes have all 64 bits cleared
+  simd::float_4 lo =
+    simd::ifelse(simd::float_4(_mm_unpacklo_ps(restart.v, restart.v)),
+                 FLOAT_4_ZERO,
+                 simd::float_4(_mm_castsi128_ps(acc_lo)));
+  simd::float_4 hi =
+    simd::ifelse(simd::float_4(_mm_unpackhi_ps(restart.v, restart.v)),
+                 FLOAT_4_ZERO,
+                 simd::float_4(_mm_castsi128_ps(acc_hi)));
+  acc_lo = _mm_castps_si128(lo.v);
+  acc_hi = _mm_castps_si128(hi.v);
+  _mm_storeu_si128((__m128i*)to, acc_lo);
+  _mm_storeu_si128((__m128i*)(to + 2), acc_hi);
+
+  wrap =
+    simd::float_4(_mm_shuffle_ps(wrap_lo, wrap_hi, _MM_SHUFFLE(2, 0, 2, 0)));
+  // the top 24 bits of each accumulator fit the low half of its lane
+  __m128 top = _mm_shuffle_ps(_mm_castsi128_ps(_mm_srli_epi64(acc_lo, 40)),
+                              _mm_castsi128_ps(_mm_srli_epi64(acc_hi, 40)),
+                              _MM_SHUFFLE(2, 0, 2, 0));
+  return simd::float_4(_mm_cvtepi32_ps(_mm_castps_si128(top))) *
+         (1.f / (1 << 24));
+}
+
+/*
+ * snap the ratios to p / q and work out the fixed engine's increments, from
+ * the knob targets and a control-rate read of the FREQ and RATE inputs. the
+ * engine and the lookahead both use these, so that they agree.
+ */
+void
+Ronda::updateFixedIncrements()
+{
+  // 2^64 / RATIO_DENOM, i.e. one cycle per sample at a ratio of 1
+  const float unit_scale = std::ldexp(1.f, 64) / RATIO_DENOM;
+  // half a cycle per sample
+  const uint64_t inc_max = UINT64_MAX >> 1;
+  for (int c = 0; c < numChannels; c += 4) {
+    simd::float_4 units = freqDeltaKnob.target * getFreqCV(c) * unit_scale;
     for (int i = 0; i < PHASORS_LEN; i++) {
-      phasors[i] = 0;
-      phsr_fl[i] = 0.f;
-      clockPulses[i].trigger();
+      simd::float_4 ratio = getInput(RATE1_INPUT + i).isConnected()
+                              ? getFreqRatio(i, c)
+                              : simd::float_4(rateKnobs.target[i]);
+      for (int k = 0; k < 4; k++) {
+        uint64_t& fixed_ratio = fixedRatios[i][c + k];
+        if (ratio[k] != fixedRatioSources[i][c + k]) {
+          fixedRatioSources[i][c + k] = ratio[k];
+          fixed_ratio = ratioToFixed(ratio[k]);
+        }
+        uint64_t unit_int = (uint64_t)units[k];
+        fixedIncs[i][c + k] = (unit_int && fixed_ratio > inc_max / unit_int)
+                                ? inc_max
+                                : unit_int * fixed_ratio;
+      }
     }
-  } else if (run) {
-    double delta = getFreqBase() * getFreqCV() * args.sampleTime;
-    double ratio = 1;
-    bool is_sync;
-    for (int i = 0; i < PHASORS_LEN; i++) {
-      is_sync = syncTriggers[i].processEvent(
-                  getInput(SYNC1_INPUT + i).getVoltage(), 0.1f, 1.0f) ==
-                dsp::SchmittTrigger::TRIGGERED;
+  }
+}
 
-      if (is_sync) {
-        phasors[i] = 0;
-        clockPulses[i].trigger();
+void
+Ronda::advanceFixed(int i,
+                    int channel,
+                    bool run,
+                    simd::float_4 restart,
+                    simd::float_4& phsr,
+                    simd::float_4& wrap)
+{
+  static const uint64_t stopped_incs[4] = {};
+  uint64_t* accs = phaseAccs[i] + channel;
+  const uint64_t* incs = run ? fixedIncs[i] + channel : stopped_incs;
+  phsr = advanceAccs(accs, accs, incs, restart, wrap);
+}
+
+void
+Ronda::convertEngineState()
+{
+  for (int i = 0; i < PHASORS_LEN; i++) {
+    for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
+      if (engine == FIXED_ENGINE) {
+        phaseAccs[i][c] = (uint64_t)std::ldexp(phasors[i][c], 64);
       } else {
-        ratio = (double)getFreqRatio(i);
-        phasors[i] += delta * ratio;
-        if (phasors[i] >= 1.0) {
-          phasors[i] = std::fmod(phasors[i], 1.0);
-          clockPulses[i].trigger();
-        }
+        phasors[i][c] = phaseAccs[i][c] * std::ldexp(1.0, -64);
       }
-      phsr_fl[i] = (float)phasors[i];
     }
-  } else {
+  }
+  activeEngine = engine;
+}
+
+/* render the first voice ahead from the current state and knob values */
+void
+Ronda::renderLookahead(float sampleTime, bool run)
+{
+  simd::float_4 phase = phaseKnobs.value;
+  simd::float_4 phsr;
+  simd::float_4 wrap;
+  simd::float_4 pulses;
+  double phsrs[4];
+  uint64_t accs[4];
+  uint64_t incs[4];
+  float delta = run ? freqDeltaKnob.value : 0.f;
+  for (int i = 0; i < PHASORS_LEN; i++) {
+    phsrs[i] = phasors[i][0];
+    pulses[i] = clockPulses[i][0][0];
+    accs[i] = phaseAccs[i][0];
+  }
+  for (int i = 0; i < PHASORS_LEN; i++) {
+    incs[i] = run ? fixedIncs[i][0] : 0;
+  }
+
+  for (int n = 0; n < LOOKAHEAD_LEN; n++) {
+    if (activeEngine == FIXED_ENGINE) {
+      const uint64_t* from = n ? lookaheadAccs[n - 1] : accs;
+      phsr = advanceAccs(from, lookaheadAccs[n], incs, FLOAT_4_ZERO, wrap);
+    } else {
+      const double* from = n ? lookaheadPhasors[n - 1] : phsrs;
+      phsr = advancePhasors(
+        from, lookaheadPhasors[n], delta, rateKnobs.value, FLOAT_4_ZERO, wrap);
+    }
+    pulses = simd::ifelse(
+      wrap, pulseLength, simd::fmax(FLOAT_4_ZERO, pulses - sampleTime));
+
+    lookaheadPulses[n] = pulses;
+    lookaheadPhases[n] = echodalia::fastmath::posmod(phsr + phase, 1.f);
+    lookaheadClocks[n] =
+      simd::ifelse(pulses > FLOAT_4_ZERO, 10.f, FLOAT_4_ZERO);
+  }
+  lookaheadLen = LOOKAHEAD_LEN;
+  lookaheadPos = 0;
+  lookaheadRun = run;
+}
+
+/* keep the state of the last replayed frame and drop the rest */
+void
+Ronda::flushLookahead()
+{
+  if (lookaheadPos > 0) {
+    int n = lookaheadPos - 1;
     for (int i = 0; i < PHASORS_LEN; i++) {
-      phsr_fl[i] = (float)phasors[i];
+      if (activeEngine == FIXED_ENGINE) {
+        phaseAccs[i][0] = lookaheadAccs[n][i];
+      } else {
+        phasors[i][0] = lookaheadPhasors[n][i];
+      }
+      clockPulses[i][0][0] = lookaheadPulses[n][i];
     }
   }
+  lookaheadLen = 0;
+  lookaheadPos = 0;
+}
 
-  simd::float_4 clk_simd;
-  for (int i = 0; i < PHASORS_LEN; i++) {
-    clk_fl[i] = (float)clockPulses[i].process(args.sampleTime);
+void
+Ronda::process(const ProcessArgs& args)
+{
+  // the range sent by RondaEx arrives one sample late
+  simd::float_4 min_v = FLOAT_4_ZERO;
+  simd::float_4 max_v = MAX_VOUT;
+  RondaRangeMessage* range =
+    (RondaRangeMessage*)getRightExpander().consumerMessage;
+  if (isExpanderPaired && range->version == RondaRangeMessage::VERSION) {
+    min_v = range->start;
+    max_v = range->end;
+  }
+
+  // the bus from pairs to the left is not watched, so chained pairs never
+  // count as steady
+  bool is_range_same =
+    simd::movemask((min_v == lastMinV) & (max_v == lastMaxV)) == 0xf;
+  if (is_range_same && !isChained && processSteady()) {
+    return;
+  }
+  lastMinV = min_v;
+  lastMaxV = max_v;
+
+  bool run = isRunning();
+  bool reset = isResetting();
+  simd::float_4 run_mask = run ? FLOAT_4_MASK : FLOAT_4_ZERO;
+  simd::float_4 reset_mask = reset ? FLOAT_4_MASK : FLOAT_4_ZERO;
+
+  if (processControlRate()) {
+    int division = controlDivider.getDivision();
+    numChannels = getNumChannels();
+    for (int i = 0; i < PHASORS_LEN; i++) {
+      setOutputChannels(PHSR1_OUTPUT + i, numChannels);
+      setOutputChannels(CLK1_OUTPUT + i, numChannels);
+    }
+    // same mappings as the param quantities' display values
+    float freq_knob =
+      echodalia::fastmath::pow(MAX_FREQ_BASE + 1,
+                               getParam(FREQ_PARAM).getValue()) -
+      1.f;
+    float freq_delta = freq_knob * args.sampleTime;
+    simd::float_4 rate_knobs =
+      echodalia::fastmath::pow(32.f, getParamVal4(RATE1_PARAM));
+    simd::float_4 phase_knobs = getParamVal4(PHASE1_PARAM, true);
+
+    // the fast path needs knobs that have settled and will not ramp
+    bool is_knob_change = (freq_delta != freqDeltaKnob.value) ||
+                          simd::movemask(rate_knobs != rateKnobs.value) ||
+                          simd::movemask(phase_knobs != phaseKnobs.value);
+    bool is_static = !is_knob_change && !isModulated();
+    if (!is_static) {
+      flushLookahead();
+    }
+    isLookaheadEnabled = is_static;
+
+    freqDeltaKnob.setTarget(freq_delta, division);
+    rateKnobs.setTarget(rate_knobs, division);
+    phaseKnobs.setTarget(phase_knobs, division);
+    if (engine == FIXED_ENGINE) {
+      updateFixedIncrements();
+    }
   }
-  clk_simd = simd::float_4::load(clk_fl) * 10.f;
-  clk_simd.store(clk_fl);
-
-  simd::float_4 phsr_simd =
-    simd::fmod(simd::float_4::load(phsr_fl) + getPhase(), 1.f);
-  if (is_expander) {
-    int conn_mask = 0;
-    simd::float_4 min_v = expander->getInputOrParamVal4(
-      RondaEx::START_INPUT, RondaEx::START_PARAM, conn_mask, true);
-    simd::float_4 max_v = expander->getInputOrParamVal4(
-      RondaEx::END_INPUT, RondaEx::END_PARAM, conn_mask, true);
-    phsr_simd *= max_v - min_v;
-    phsr_simd += min_v;
-    RondaExMessage* msg =
-      (RondaExMessage*)expander->getLeftExpander().producerMessage;
-    msg->phasor = phsr_simd;
-    msg->clock = clk_simd;
+  simd::float_4 freq_base = freqDeltaKnob.process();
+  rateKnobs.process();
+  phaseKnobs.process();
+
+  if (engine != activeEngine) {
+    flushLookahead();
+    convertEngineState();
+    if (activeEngine == FIXED_ENGINE) {
+      updateFixedIncrements();
+    }
+  }
+  if (reset || run != lookaheadRun) {
+    flushLookahead();
+  }
+
+  /* first voice, unscaled, for the expander */
+  float phsr_fl[4];
+  float clk_fl[4];
+  int clocks_high = 0;
+  if (isLookaheadEnabled && !reset) {
+    if (lookaheadPos >= lookaheadLen) {
+      flushLookahead();
+      renderLookahead(args.sampleTime, run);
+    }
+    simd::float_4 phase = lookaheadPhases[lookaheadPos];
+    simd::float_4 clk = lookaheadClocks[lookaheadPos];
+    lookaheadPos++;
+    clocks_high = simd::movemask(clk > FLOAT_4_ZERO);
+    simd::float_4 out = phase * (max_v - min_v) + min_v;
+    for (int i = 0; i < PHASORS_LEN; i++) {
+      if (isOutputConnected(PHSR1_OUTPUT + i)) {
+        getOutput(PHSR1_OUTPUT + i).setVoltage(out[i]);
+      }
+      if (isOutputConnected(CLK1_OUTPUT + i)) {
+        getOutput(CLK1_OUTPUT + i).setVoltage(clk[i]);
+      }
+    }
+    phase.store(phsr_fl);
+    clk.store(clk_fl);
   } else {
-    phsr_simd *= MAX_VOUT;
+    for (int c = 0, b = 0; c < numChannels; c += 4, b++) {
+      simd::float_4 delta = FLOAT_4_ZERO;
+      if (activeEngine == FLOAT_ENGINE) {
+        delta = (freq_base * getFreqCV(c)) & run_mask;
+      }
+      for (int i = 0; i < PHASORS_LEN; i++) {
+        simd::float_4 sync =
+          syncTriggers[i][b].process(
+            getInput(SYNC1_INPUT + i).getPolyVoltageSimd<simd::float_4>(c),
+            0.1f,
+            1.f) &
+          run_mask;
+        simd::float_4 restart = sync | reset_mask;
+
+        simd::float_4 phsr;
+        simd::float_4 wrap;
+        if (activeEngine == FIXED_ENGINE) {
+          advanceFixed(i, c, run, restart, phsr, wrap);
+        } else {
+          simd::float_4 ratio = getFreqRatio(i, c);
+          advanceFloat(i, c, delta, ratio, restart, phsr, wrap);
+        }
+
+        clockPulses[i][b] = simd::ifelse(
+          restart | wrap,
+          pulseLength,
+          simd::fmax(FLOAT_4_ZERO, clockPulses[i][b] - args.sampleTime));
+        simd::float_4 is_clock_high = clockPulses[i][b] > FLOAT_4_ZERO;
+        simd::float_4 clk = simd::ifelse(is_clock_high, 10.f, FLOAT_4_ZERO);
+        clocks_high |= simd::movemask(is_clock_high);
+
+        simd::float_4 phase =
+          echodalia::fastmath::posmod(phsr + getPhase(i, c), 1.f);
+
+        // the phasors keep running for the expander and the panel, but
+        // only outputs with a cable are written
+        if (isOutputConnected(PHSR1_OUTPUT + i)) {
+          simd::float_4 out = phase * (max_v[i] - min_v[i]) + min_v[i];
+          getOutput(PHSR1_OUTPUT + i).setVoltageSimd(out, c);
+        }
+        if (isOutputConnected(CLK1_OUTPUT + i)) {
+          getOutput(CLK1_OUTPUT + i).setVoltageSimd(clk, c);
+        }
+        if (!b) {
+          phsr_fl[i] = phase[0];
+          clk_fl[i] = clk[0];
+        }
+      }
+    }
   }
 
-  phsr_simd.store(phsr_fl);
-  for (int i = 0; i < PHASORS_LEN; i++) {
-    getOutput(PHSR1_OUTPUT + i).setVoltage(phsr_fl[i]);
-    getOutput(CLK1_OUTPUT + i).setVoltage(clk_fl[i]);
+  if (processSnapshotRate()) {
+    Snapshot& snapshot = snapshots.getWriteSlot();
+    std::copy(phsr_fl, phsr_fl + PHASORS_LEN, snapshot.phases);
+    snapshots.publish();
   }
 
-  if (is_expander) {
-    expander->getLeftExpander().requestMessageFlip();
+  // the expander carries the first voice only
+  if (isExpanderPaired) {
+    Expander& ex_side = getRightExpander().module->getLeftExpander();
+    RondaExMessage* msg = (RondaExMessage*)ex_side.producerMessage;
+    msg->version = RondaExMessage::VERSION;
+    msg->phasor = simd::float_4::load(phsr_fl);
+    msg->clock = simd::float_4::load(clk_fl);
+    // pass on the bus from pairs to the left
+    RondaBusMessage* upstream =
+      (RondaBusMessage*)getLeftExpander().consumerMessage;
+    if (isChained && upstream->version == RondaBusMessage::VERSION) {
+      msg->bus = upstream->bus;
+    } else {
+      msg->bus.len = 0;
+    }
+    ex_side.requestMessageFlip();
   }
+
+  // once stopped, the phasors hold still as soon as the phase knobs finish
+  // ramping and the clock pulses end; the pair's messages stay in place
+  setSteady(!run && !clocks_high &&
+            !simd::movemask(phaseKnobs.value != phaseKnobs.target));
+}
+
+json_t*
+Ronda::dataToJson()
+{
+  json_t* root = json_object();
+  json_object_set_new(root, "engine", json_integer(engine));
+  return echodalia::EDModule::dataToJson(root);
+}
+
+void
+Ronda::dataFromJson(json_t* root)
+{
+  json_t* val = json_object_get(root, "engine");
+  // unknown engines, e.g. from a later version, leave the default in place
+  if (json_is_integer(val) && json_integer_value(val) >= 0 &&
+      json_integer_value(val) < ENGINES_LEN) {
+    engine = (Engine)json_integer_value(val);
+  }
+  echodalia::EDModule::dataFromJson(root);
 }
 
 struct RondaWidget : echodalia::EDModuleWidget
 {
 public:
+  echodalia::PhaseRing* phaseRings[Ronda::PHASORS_LEN];
+
   RondaWidget(Ronda* ronda)
   {
     constexpr float XG = 2.54;
@@ -293,6 +802,10 @@ public:
         mm2px(Vec(x, 34 * YG)), ronda, Ronda::PHASE1_INPUT + i));
       addInput(createInputCentered<PJ301MPort>(
         mm2px(Vec(x, 41 * YG)), ronda, Ronda::SYNC1_INPUT + i));
+      phaseRings[i] = createWidget<echodalia::PhaseRing>(
+        mm2px(Vec(x - 5.25, 48 * YG - 5.25)));
+      phaseRings[i]->box.size = mm2px(Vec(10.5, 10.5));
+      addChild(phaseRings[i]);
       addOutput(createOutputCentered<PJ301MPort>(
         mm2px(Vec(x, 48 * YG)), ronda, Ronda::PHSR1_OUTPUT + i));
       addOutput(createOutputCentered<PJ301MPort>(
@@ -316,6 +829,29 @@ public:
     }
     // setPanelTheme(ronda->panelTheme);
   }
+
+  void appendContextMenu(Menu* menu) override
+  {
+    Ronda* ronda = getModule<Ronda>();
+    menu->addChild(new MenuSeparator);
+    menu->addChild(createIndexPtrSubmenuItem(
+      "Phasor engine",
+      { "Floating point", "Fixed point (drift-free)" },
+      &ronda->engine));
+    echodalia::EDModuleWidget::appendContextMenu(menu);
+  }
+
+  void step() override
+  {
+    Ronda* ronda = getModule<Ronda>();
+    if (ronda) {
+      const Ronda::Snapshot& snapshot = ronda->snapshots.read();
+      for (int i = 0; i < Ronda::PHASORS_LEN; i++) {
+        phaseRings[i]->phase = snapshot.phases[i];
+      }
+    }
+    echodalia::EDModuleWidget::step();
+  }
 };
 
 Model* modelRonda = createModel<Ronda, RondaWidget>("Ronda");
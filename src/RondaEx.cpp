@@ -1,11 +1,31 @@
+#include <cmath>
 #include <string>
 
 #include "RondaEx.hpp"
+#include "fastmath.hpp"
 #include "plugin.hpp"
 #include "widgets.hpp"
 
 using namespace rack;
 
+float RondaEx::shapeTables[SHAPES_LEN][SHAPE_TABLE_SIZE + 1];
+
+void
+RondaEx::initShapes()
+{
+  // steepness of the exponential and logarithmic curves, in octaves
+  const double curve = 5.0;
+  const double curve_range = std::exp2(curve) - 1.0;
+  for (int k = 0; k <= SHAPE_TABLE_SIZE; k++) {
+    double x = (double)k / SHAPE_TABLE_SIZE;
+    shapeTables[RAMP_SHAPE][k] = x;
+    shapeTables[SINE_SHAPE][k] = 0.5 - 0.5 * std::cos(2.0 * M_PI * x);
+    shapeTables[TRIANGLE_SHAPE][k] = 1.0 - std::fabs(2.0 * x - 1.0);
+    shapeTables[EXP_SHAPE][k] = (std::exp2(curve * x) - 1.0) / curve_range;
+    shapeTables[LOG_SHAPE][k] = std::log2(1.0 + x * curve_range) / curve;
+  }
+}
+
 RondaEx::RondaEx()
 {
   config(PARAMS_LEN, INPUTS_LEN, OUTPUTS_LEN, LIGHTS_LEN);
@@ -22,18 +42,129 @@ RondaEx::RondaEx()
 
   getOutput(PHSR_POLY_OUTPUT).setChannels(4);
 
-  getLeftExpander().producerMessage = &message[0];
-  getLeftExpander().consumerMessage = &message[1];
+  messages.attach(getLeftExpander());
+}
+
+/* map each lane of a 0-1 phasor through the shape of its phasor */
+simd::float_4
+RondaEx::applyShapes(simd::float_4 phasor)
+{
+  const float* tables[PHASORS_LEN];
+  bool is_linear = true;
+  for (int i = 0; i < PHASORS_LEN; i++) {
+    tables[i] = shapeTables[shapes[i]];
+    is_linear = is_linear && shapes[i] == RAMP_SHAPE;
+  }
+  if (is_linear) {
+    return phasor;
+  }
+  return echodalia::fastmath::interpolate(tables, SHAPE_TABLE_SIZE, phasor);
+}
+
+void
+RondaEx::onExpanderChange(const ExpanderChangeEvent& e)
+{
+  Module* neighbour = getExpander(e.side).module;
+  bool is_ronda = neighbour && neighbour->getModel() == modelRonda;
+  if (e.side) {
+    isChained = is_ronda;
+  } else {
+    isPaired = is_ronda;
+  }
 }
 
+/*
+ * Ronda and RondaEx only exchange messages, and never read each other's ports
+ * or params, so they can run on different engine threads
+ */
 void
 RondaEx::process(const ProcessArgs& args)
 {
+  int conn_mask = 0;
+  simd::float_4 start =
+    getInputOrParamVal4(START_INPUT, START_PARAM, conn_mask, true);
+  simd::float_4 end =
+    getInputOrParamVal4(END_INPUT, END_PARAM, conn_mask, true);
+
   RondaExMessage* msg = (RondaExMessage*)getLeftExpander().consumerMessage;
-  getOutput(PHSR_POLY_OUTPUT).setChannels(4);
-  getOutput(PHSR_POLY_OUTPUT).setVoltageSimd(msg->phasor, 0);
-  getOutput(CLK_POLY_OUTPUT).setChannels(4);
-  getOutput(CLK_POLY_OUTPUT).setVoltageSimd(msg->clock, 0);
+  simd::float_4 phasor = FLOAT_4_ZERO;
+  simd::float_4 clock = FLOAT_4_ZERO;
+  bool is_valid = isPaired && msg->version == RondaExMessage::VERSION;
+  if (is_valid) {
+    phasor = applyShapes(msg->phasor) * (end - start) + start;
+    clock = msg->clock;
+  }
+
+  // add this pair's block after those of the pairs to the left; pairs past
+  // the fourth are left off the bus
+  RondaBus bus;
+  bus.len = 0;
+  if (is_valid) {
+    bus = msg->bus;
+  }
+  if (bus.len < RondaBus::BLOCKS_MAX) {
+    bus.phasors[bus.len] = phasor;
+    bus.clocks[bus.len] = clock;
+    bus.len++;
+  }
+
+  setOutputChannels(PHSR_POLY_OUTPUT, bus.len * 4);
+  setOutputChannels(CLK_POLY_OUTPUT, bus.len * 4);
+  for (int b = 0; b < bus.len; b++) {
+    if (isOutputConnected(PHSR_POLY_OUTPUT)) {
+      getOutput(PHSR_POLY_OUTPUT).setVoltageSimd(bus.phasors[b], b * 4);
+    }
+    if (isOutputConnected(CLK_POLY_OUTPUT)) {
+      getOutput(CLK_POLY_OUTPUT).setVoltageSimd(bus.clocks[b], b * 4);
+    }
+  }
+
+  if (isChained) {
+    Expander& next_side = getRightExpander().module->getLeftExpander();
+    RondaBusMessage* next = (RondaBusMessage*)next_side.producerMessage;
+    next->version = RondaBusMessage::VERSION;
+    next->bus = bus;
+    next_side.requestMessageFlip();
+  }
+
+  // Ronda scales its own outputs to the same range
+  if (isPaired) {
+    Expander& ronda_side = getLeftExpander().module->getRightExpander();
+    RondaRangeMessage* range = (RondaRangeMessage*)ronda_side.producerMessage;
+    range->version = RondaRangeMessage::VERSION;
+    range->start = start;
+    range->end = end;
+    ronda_side.requestMessageFlip();
+  }
+}
+
+json_t*
+RondaEx::dataToJson()
+{
+  json_t* root = json_object();
+  json_t* shps = json_array();
+  for (int i = 0; i < PHASORS_LEN; i++) {
+    json_array_append_new(shps, json_integer(shapes[i]));
+  }
+  json_object_set_new(root, "shapes", shps);
+  return echodalia::EDModule::dataToJson(root);
+}
+
+void
+RondaEx::dataFromJson(json_t* root)
+{
+  json_t* val = json_object_get(root, "shapes");
+  if (json_is_array(val)) {
+    for (size_t i = 0; (i < json_array_size(val)) && (i < PHASORS_LEN); i++) {
+      json_t* shp = json_array_get(val, i);
+      // shapes index the tables, so unknown ones are skipped
+      if (json_is_integer(shp) && json_integer_value(shp) >= 0 &&
+          json_integer_value(shp) < SHAPES_LEN) {
+        shapes[i] = (Shape)json_integer_value(shp);
+      }
+    }
+  }
+  echodalia::EDModule::dataFromJson(root);
 }
 
 struct RondaExWidget : echodalia::EDModuleWidget
@@ -74,6 +205,19 @@ struct RondaExWidget : echodalia::EDModuleWidget
     addOutput(createOutputCentered<PJ301MPort>(
       mm2px(Vec(xb, ya)), ronda_ex, RondaEx::CLK_POLY_OUTPUT));
   }
+
+  void appendContextMenu(Menu* menu) override
+  {
+    RondaEx* ronda_ex = getModule<RondaEx>();
+    menu->addChild(new MenuSeparator);
+    for (int i = 0; i < RondaEx::PHASORS_LEN; i++) {
+      menu->addChild(createIndexPtrSubmenuItem(
+        "Phasor " + std::to_string(i + 1) + " shape",
+        { "Ramp", "Sine", "Triangle", "Exponential", "Logarithmic" },
+        &ronda_ex->shapes[i]));
+    }
+    echodalia::EDModuleWidget::appendContextMenu(menu);
+  }
 };
 
 Model* modelRondaEx = createModel<RondaEx, RondaExWidget>("RondaEx");
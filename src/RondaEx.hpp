@@ -1,11 +1,53 @@
+#pragma once
+
 #include "plugin.hpp"
 
 using namespace rack;
 
+/*
+ * the phasors and clocks of up to four chained Ronda/RondaEx pairs, one block
+ * of 4 channels per pair in chain order. blocks are forwarded whole from pair
+ * to pair, each hop adding a sample of latency.
+ */
+struct RondaBus
+{
+  static const int BLOCKS_MAX = 4;
+  int32_t len;
+  simd::float_4 phasors[BLOCKS_MAX];
+  simd::float_4 clocks[BLOCKS_MAX];
+};
+
+/*
+ * Ronda to RondaEx: the first voice's phasors, after phase offset but before
+ * scaling, and clocks, plus the bus from pairs further left
+ */
 struct RondaExMessage
 {
+  static const int32_t VERSION = 2;
+  /* 0 until Ronda has written the message */
+  int32_t version;
   simd::float_4 phasor;
   simd::float_4 clock;
+  RondaBus bus;
+};
+
+/* RondaEx to the Ronda on its right: the bus so far */
+struct RondaBusMessage
+{
+  static const int32_t VERSION = 1;
+  /* 0 until RondaEx has written the message */
+  int32_t version;
+  RondaBus bus;
+};
+
+/* RondaEx to Ronda: the output range of each phasor */
+struct RondaRangeMessage
+{
+  static const int32_t VERSION = 1;
+  /* 0 until RondaEx has written the message */
+  int32_t version;
+  simd::float_4 start;
+  simd::float_4 end;
 };
 
 struct RondaEx : echodalia::EDModule
@@ -34,10 +76,33 @@ public:
   {
     LIGHTS_LEN
   };
+  /* curves applied to each phasor before scaling between start and end */
+  enum Shape
+  {
+    RAMP_SHAPE,
+    SINE_SHAPE,
+    TRIANGLE_SHAPE,
+    EXP_SHAPE,
+    LOG_SHAPE,
+    SHAPES_LEN
+  };
+  static const int SHAPE_TABLE_SIZE = 512;
+  /* filled once by initShapes(), from the plugin's init() */
+  static float shapeTables[SHAPES_LEN][SHAPE_TABLE_SIZE + 1];
+
+  Shape shapes[PHASORS_LEN] = {};
+  echodalia::ExpanderMessagePair<RondaExMessage> messages;
+  /* true while a Ronda is on the left; set in onExpanderChange */
+  bool isPaired = false;
+  /* true while another Ronda is on the right to take the bus onwards */
+  bool isChained = false;
 
-  RondaExMessage message[2] = {};
+  static void initShapes();
 
   RondaEx();
+  simd::float_4 applyShapes(simd::float_4 phasor);
+  void onExpanderChange(const ExpanderChangeEvent& e) override;
   void process(const ProcessArgs& args) override;
+  json_t* dataToJson() override;
+  void dataFromJson(json_t* root) override;
 };
-
@@ -0,0 +1,17 @@
+#include "fastmath.hpp"
+
+namespace echodalia {
+namespace fastmath {
+
+float exp2Table[EXP2_TABLE_SIZE + 1];
+
+void
+init()
+{
+  for (int k = 0; k <= EXP2_TABLE_SIZE; k++) {
+    exp2Table[k] = std::exp2((double)k / EXP2_TABLE_SIZE);
+  }
+}
+
+} // namespace fastmath
+} // namespace echodalia
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "rack.hpp"
+
+namespace echodalia {
+
+/*
+ * table-based replacements for the libm calls on the per-sample paths.
+ * init() must run before any kernel is used; the plugin's init() does this.
+ */
+namespace fastmath {
+
+/* 2^(k / EXP2_TABLE_SIZE) for k in [0, EXP2_TABLE_SIZE] */
+static const int EXP2_TABLE_SIZE = 64;
+extern float exp2Table[EXP2_TABLE_SIZE + 1];
+
+void
+init();
+
+/* maximum errors of the kernels below, as checked by tests/fastmath.cpp */
+static const double EXP2_ERROR = 3e-7;
+static const double POW_EXPONENT_ERROR = 8.3e-8;
+static const double POSMOD_ERROR = 6e-8;
+
+/*
+ * 2^x for x in [-126, 126], clamped outside that range. the table covers the
+ * top 6 bits of the fraction and a cubic covers the rest, for a maximum
+ * relative error of EXP2_ERROR (about 3 ulp).
+ */
+inline rack::simd::float_4
+exp2(rack::simd::float_4 x)
+{
+  using namespace rack::simd;
+  x = clamp(x, -126.f, 126.f);
+  float_4 xi = floor(x);
+  float_4 t = (x - xi) * EXP2_TABLE_SIZE;
+  int32_4 k = int32_4(t);
+  float_4 r = (t - float_4(k)) * (1.f / EXP2_TABLE_SIZE);
+  float_4 tab = { exp2Table[k[0]],
+                  exp2Table[k[1]],
+                  exp2Table[k[2]],
+                  exp2Table[k[3]] };
+  // taylor series of 2^r for r < 1/64; the truncation error is below 1e-9
+  float_4 p =
+    1.f + r * (0.69314718f + r * (0.24022651f + r * 0.05550411f));
+  // scale by 2^xi by adding to the exponent bits
+  int32_4 bits = int32_4::cast(tab * p) + (int32_4(xi) << 23);
+  return float_4::cast(bits);
+}
+
+inline float
+exp2(float x)
+{
+  return exp2(rack::simd::float_4(x))[0];
+}
+
+/*
+ * base^x for a positive constant base, with the error of exp2 plus that of
+ * rounding log2(base) and x * log2(base): a relative error below
+ * EXP2_ERROR + POW_EXPONENT_ERROR * |x * log2(base)|. log2 of a constant base
+ * is folded at compile time.
+ */
+inline rack::simd::float_4
+pow(float base, rack::simd::float_4 x)
+{
+  return exp2(x * std::log2(base));
+}
+
+inline float
+pow(float base, float x)
+{
+  return exp2(x * std::log2(base));
+}
+
+/*
+ * x mod m with the sign of m (like python's %), for m > 0. the result is
+ * exact when x / m is exact, except that tiny negative x can give 0 rather
+ * than just under m (an error of POSMOD_ERROR * m), and never reaches m.
+ */
+inline rack::simd::float_4
+posmod(rack::simd::float_4 x, rack::simd::float_4 m)
+{
+  using namespace rack::simd;
+  float_4 y = x - floor(x / m) * m;
+  // tiny negative x can round up to m
+  return ifelse(y >= m, 0.f, y);
+}
+
+inline float
+posmod(float x, float m)
+{
+  float y = x - std::floor(x / m) * m;
+  return (y >= m) ? 0.f : y;
+}
+
+/*
+ * linear interpolation in tables of size + 1 points spanning x = 0 to 1, with
+ * one table per lane. x is clamped to [0, 1].
+ */
+inline rack::simd::float_4
+interpolate(const float* const tables[4], int size, rack::simd::float_4 x)
+{
+  using namespace rack::simd;
+  float_4 t = clamp(x, 0.f, 1.f) * size;
+  int32_4 k = int32_4(t);
+  // x == 1 interpolates towards the last point from below
+  k = ifelse(k > int32_4(size - 1), int32_4(size - 1), k);
+  float_4 frac = t - float_4(k);
+  float_4 a = { tables[0][k[0]],
+                tables[1][k[1]],
+                tables[2][k[2]],
+                tables[3][k[3]] };
+  float_4 b = { tables[0][k[0] + 1],
+                tables[1][k[1] + 1],
+                tables[2][k[2] + 1],
+                tables[3][k[3] + 1] };
+  return a + (b - a) * frac;
+}
+
+} // namespace fastmath
+} // namespace echodalia
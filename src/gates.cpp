@@ -0,0 +1,17 @@
+#include "gates.hpp"
+
+namespace echodalia {
+namespace gates {
+
+bool hasAvx2 = false;
+
+void
+init()
+{
+#ifdef ECHODALIA_AVX2
+  hasAvx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+} // namespace gates
+} // namespace echodalia
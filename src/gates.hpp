@@ -0,0 +1,178 @@
+#pragma once
+
+#include <cstdint>
+
+#include "rack.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+/*
+ * builds one function for AVX2, leaving the rest of the plugin on the SSE
+ * baseline; only call such functions once init() has set hasAvx2
+ */
+#define ECHODALIA_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace echodalia {
+
+/*
+ * kernels over the 16 channels of a polyphonic gate, one bit per channel in
+ * uint16_t masks. Sse and Avx2 share one interface, so a caller templated on
+ * the kernel set is instantiated once per instruction set, and the kernels
+ * inline into it.
+ */
+namespace gates {
+
+/* whether the CPU runs the Avx2 kernels, set once by init() */
+extern bool hasAvx2;
+
+void
+init();
+
+struct Sse
+{
+  /* a float_4 mask with lane k set where bit k of bits is set */
+  static rack::simd::float_4 expandMask(int bits)
+  {
+    const rack::simd::int32_4 lane_bits(1, 2, 4, 8);
+    return rack::simd::float_4::cast((rack::simd::int32_4(bits) & lane_bits) ==
+                                     lane_bits);
+  }
+
+  /*
+   * Schmitt triggers on the first 4 * blocks voltages, switching on at 1 V and
+   * off at 0 V; returns the new states, leaving the other channels' as they
+   * were
+   */
+  static uint16_t schmitt(const float* voltages, uint16_t states, int blocks)
+  {
+    using namespace rack::simd;
+    int result = states & ~((1 << (blocks * 4)) - 1);
+    for (int i = 0; i < blocks * 4; i += 4) {
+      float_4 v = float_4::load(voltages + i);
+      int on = movemask(v >= 1.f);
+      int off = movemask(v <= 0.f);
+      int state = (states >> i) & 0xf;
+      result |= (on | (state & ~off)) << i;
+    }
+    return result;
+  }
+
+  /*
+   * restart the 16 pulses with an edge and count down the rest, skipping
+   * channels with neither; returns the channels still pulsing
+   */
+  static uint16_t processPulses(float* pulses,
+                                uint16_t edges,
+                                uint16_t pulsing,
+                                float length,
+                                float sampleTime)
+  {
+    using namespace rack::simd;
+    int still_pulsing = 0;
+    for (int i = 0; i < 16; i += 4) {
+      int block_edges = (edges >> i) & 0xf;
+      if (!(block_edges | ((pulsing >> i) & 0xf))) {
+        continue;
+      }
+      float_4 p =
+        ifelse(expandMask(block_edges),
+               length,
+               fmax(float_4::zero(), float_4::load(pulses + i) - sampleTime));
+      p.store(pulses + i);
+      still_pulsing |= movemask(p > float_4::zero()) << i;
+    }
+    return still_pulsing;
+  }
+
+  /* write high or low to the first 4 * blocks voltages, as set in bits */
+  static void expand(float* voltages,
+                     uint16_t bits,
+                     float high,
+                     float low,
+                     int blocks)
+  {
+    for (int i = 0; i < blocks * 4; i += 4) {
+      rack::simd::ifelse(expandMask(bits >> i), high, low).store(voltages + i);
+    }
+  }
+};
+
+#ifdef ECHODALIA_AVX2
+/* the same kernels, 8 channels per op */
+struct Avx2
+{
+  /* lane k of a mask is set where bit k of bits is set */
+  ECHODALIA_AVX2 static __m256 expandMask(int bits)
+  {
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i b = _mm256_and_si256(_mm256_set1_epi32(bits), lane_bits);
+    return _mm256_castsi256_ps(_mm256_cmpeq_epi32(b, lane_bits));
+  }
+
+  ECHODALIA_AVX2 static uint16_t schmitt(const float* voltages,
+                                         uint16_t states,
+                                         int blocks)
+  {
+    // reading past the last block is safe, since ports hold 16 voltages
+    int active = (1 << (blocks * 4)) - 1;
+    int result = 0;
+    for (int i = 0; i < blocks * 4; i += 8) {
+      __m256 v = _mm256_loadu_ps(voltages + i);
+      int on =
+        _mm256_movemask_ps(_mm256_cmp_ps(v, _mm256_set1_ps(1.f), _CMP_GE_OQ));
+      int off =
+        _mm256_movemask_ps(_mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_LE_OQ));
+      int state = (states >> i) & 0xff;
+      result |= (on | (state & ~off)) << i;
+    }
+    return (result & active) | (states & ~active);
+  }
+
+  ECHODALIA_AVX2 static uint16_t processPulses(float* pulses,
+                                               uint16_t edges,
+                                               uint16_t pulsing,
+                                               float length,
+                                               float sampleTime)
+  {
+    int still_pulsing = 0;
+    for (int i = 0; i < 16; i += 8) {
+      int block_edges = (edges >> i) & 0xff;
+      if (!(block_edges | ((pulsing >> i) & 0xff))) {
+        continue;
+      }
+      __m256 p = _mm256_max_ps(
+        _mm256_setzero_ps(),
+        _mm256_sub_ps(_mm256_loadu_ps(pulses + i), _mm256_set1_ps(sampleTime)));
+      p = _mm256_blendv_ps(p, _mm256_set1_ps(length), expandMask(block_edges));
+      _mm256_storeu_ps(pulses + i, p);
+      still_pulsing |=
+        _mm256_movemask_ps(_mm256_cmp_ps(p, _mm256_setzero_ps(), _CMP_GT_OQ))
+        << i;
+    }
+    return still_pulsing;
+  }
+
+  ECHODALIA_AVX2 static void expand(float* voltages,
+                                    uint16_t bits,
+                                    float high,
+                                    float low,
+                                    int blocks)
+  {
+    int len = blocks * 4;
+    for (int i = 0; i < len; i += 8) {
+      __m256 v = _mm256_blendv_ps(
+        _mm256_set1_ps(low), _mm256_set1_ps(high), expandMask(bits >> i));
+      if (len - i < 8) {
+        // leave the channels past the last block alone
+        _mm_storeu_ps(voltages + i, _mm256_castps256_ps128(v));
+      } else {
+        _mm256_storeu_ps(voltages + i, v);
+      }
+    }
+  }
+};
+#endif
+
+} // namespace gates
+} // namespace echodalia
@@ -1,9 +1,141 @@
+#include "RondaEx.hpp"
+#include "fastmath.hpp"
+#include "gates.hpp"
 #include "plugin.hpp"
+#include <cstring>
 
 rack::Plugin* pluginInstance;
 
 namespace echodalia {
 
+EDModule::EDModule()
+{
+  controlDivider.setDivision(CONTROL_DIVISION);
+  snapshotDivider.setDivision(SNAPSHOT_DIVISION);
+}
+
+bool
+EDModule::processControlRate()
+{
+  bool is_due = controlDivider.process() || isControlRefreshDue;
+  isControlRefreshDue = false;
+  return is_due;
+}
+
+bool
+EDModule::processSnapshotRate()
+{
+  return snapshotDivider.process();
+}
+
+bool
+EDModule::processSteady()
+{
+  if (!isWatchingInputs) {
+    return false;
+  }
+  areInputsQuiet = processInputChanges();
+  // leave samples that refresh controls or publish snapshots to process()
+  if (!isSteady || !areInputsQuiet || isControlRefreshDue ||
+      controlDivider.getClock() + 1 >= controlDivider.getDivision() ||
+      snapshotDivider.getClock() + 1 >= snapshotDivider.getDivision()) {
+    return false;
+  }
+  controlDivider.process();
+  snapshotDivider.process();
+  return true;
+}
+
+bool
+EDModule::processInputChanges()
+{
+  for (size_t i = 0; i < inputs.size(); i++) {
+    if (!isInputConnected(i)) {
+      continue;
+    }
+    int channels = inputs[i].getChannels();
+    const float* voltages = inputs[i].getVoltages();
+    float* copy = &steadyVoltages[i * PORT_MAX_CHANNELS];
+    if (channels != steadyChannels[i] ||
+        std::memcmp(voltages, copy, channels * sizeof(float))) {
+      steadyChannels[i] = channels;
+      std::memcpy(copy, voltages, channels * sizeof(float));
+      return false;
+    }
+  }
+  for (size_t i = 0; i < params.size(); i++) {
+    float value = params[i].getValue();
+    if (value != steadyParams[i]) {
+      steadyParams[i] = value;
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * a quiet compare leaves every copy equal to this sample's params and inputs,
+ * so while they hold still the outputs written now stay right. once they
+ * move, they are next compared after a control frame, so that inputs moving
+ * every sample cost one compare per control period.
+ */
+void
+EDModule::setSteady(bool steady)
+{
+  isSteady = steady && areInputsQuiet;
+  isWatchingInputs = steady && (areInputsQuiet || !controlDivider.getClock());
+  areInputsQuiet = false;
+}
+
+void
+EDModule::onAdd(const AddEvent& e)
+{
+  // config() has run by now, and this is off the engine thread
+  steadyParams.resize(params.size());
+  steadyChannels.resize(inputs.size());
+  steadyVoltages.resize(inputs.size() * PORT_MAX_CHANNELS);
+}
+
+void
+EDModule::onSampleRateChange(const SampleRateChangeEvent& e)
+{
+  controlSampleTime = e.sampleTime * controlDivider.getDivision();
+  isControlRefreshDue = true;
+}
+
+void
+EDModule::onPortChange(const PortChangeEvent& e)
+{
+  // outputs can have several cables, so ask the port rather than trusting
+  // e.connecting
+  bool is_input = e.type == rack::Port::INPUT;
+  bool is_connected = is_input ? getInput(e.portId).isConnected()
+                               : getOutput(e.portId).isConnected();
+  uint64_t& mask = is_input ? connectedInputs : connectedOutputs;
+  uint64_t bit = (uint64_t)1 << e.portId;
+  mask = is_connected ? (mask | bit) : (mask & ~bit);
+  // a new cable may be on an output that has not been written for a while
+  isSteady = false;
+  isControlRefreshDue = true;
+}
+
+void
+EDModule::onUnBypass(const UnBypassEvent& e)
+{
+  // the outputs may have been changed while bypassed
+  isSteady = false;
+  isControlRefreshDue = true;
+}
+
+void
+EDModule::setOutputChannels(int output, int channels)
+{
+  rack::Output& port = getOutput(output);
+  if (isOutputConnected(output) && port.getChannels() != channels) {
+    port.setChannels(channels);
+  }
+}
+
 float
 EDModule::getInputOrParamVal(int input, int param)
 {
@@ -15,16 +147,17 @@ float
 EDModule::getInputOrParamVal(int input,
                              int param,
                              bool& isInputConnected,
-                             bool useDisplayVal)
+                             bool useDisplayVal,
+                             int channel)
 {
   isInputConnected = false;
-  rack::Input port = getInput(input);
+  rack::Input& port = getInput(input);
   if (!port.isConnected()) {
     return useDisplayVal ? getParamQuantity(param)->getDisplayValue()
                          : getParam(param).getValue();
   }
   isInputConnected = true;
-  return port.getVoltage();
+  return port.getPolyVoltage(channel);
 }
 
 rack::simd::float_4
@@ -45,13 +178,14 @@ rack::simd::float_4
 EDModule::getInputOrParamVal4(int input1st,
                               int param1st,
                               int& inputConnMask,
-                              bool useDisplayVal)
+                              bool useDisplayVal,
+                              int channel)
 {
   bool is_input_conn = false;
   float raw_vals[4];
   for (int i = 0; i < 4; i++) {
     raw_vals[i] = getInputOrParamVal(
-      input1st + i, param1st + i, is_input_conn, useDisplayVal);
+      input1st + i, param1st + i, is_input_conn, useDisplayVal, channel);
     if (is_input_conn) {
       inputConnMask = (1 << i) + inputConnMask;
     }
@@ -80,6 +214,7 @@ EDModule::dataFromJson(json_t* root)
     panelTheme = json_integer_value(val);
     // std::cout << "set panel theme to " << panelTheme << "\n";
   }
+  isSteady = false;
 }
 } // namespace echodalia
 
@@ -110,11 +245,15 @@ void
 init(rack::Plugin* p)
 {
   pluginInstance = p;
+  echodalia::fastmath::init();
+  echodalia::gates::init();
+  RondaEx::initShapes();
 
   // Add modules here
   p->addModel(modelRonda);
   p->addModel(modelRondaEx);
   p->addModel(modelJab);
+  p->addModel(modelJabQuad);
   p->addModel(modelAgate);
 }
 
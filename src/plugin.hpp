@@ -1,6 +1,9 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <iostream>
+#include <new>
 
 #include "rack.hpp"
 
@@ -17,20 +20,204 @@ const std::vector<std::string> THEME_NAMES = { "Black",
                                                "Red",
                                                "Grey-green" };
 
+/*
+ * ramps linearly to each new control-rate target over a number of samples, so
+ * the audio-rate loop sees knob changes without stepping
+ */
+template<typename T = float>
+struct ControlSmoother
+{
+  T value = 0.f;
+  T target = 0.f;
+  T step = 0.f;
+  int remaining = 0;
+  bool isInitialized = false;
+
+  void setTarget(T newTarget, int frames)
+  {
+    target = newTarget;
+    if (!isInitialized) {
+      // jump to the first value instead of ramping up from zero
+      value = target;
+      remaining = 0;
+      isInitialized = true;
+      return;
+    }
+    step = (target - value) / (float)frames;
+    remaining = frames;
+  }
+
+  T process()
+  {
+    if (remaining > 0) {
+      value += step;
+      if (--remaining == 0) {
+        value = target;
+      }
+    }
+    return value;
+  }
+};
+
+/*
+ * the double buffer for one side's expander messages, with each message on
+ * cache lines of its own so that neighbouring modules on other threads never
+ * share a line with it. the buffers are aligned by hand inside padded storage,
+ * since aligned new for over-aligned types needs C++17.
+ */
+template<typename T>
+struct ExpanderMessagePair
+{
+  static const size_t CACHE_LINE_SIZE = 64;
+  static const size_t SLOT_SIZE =
+    (sizeof(T) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+  unsigned char storage[2 * SLOT_SIZE + CACHE_LINE_SIZE];
+
+  /* place both messages, zeroed, and hand them to the expander */
+  void attach(rack::Module::Expander& expander)
+  {
+    uintptr_t base = ((uintptr_t)storage + CACHE_LINE_SIZE - 1) &
+                     ~(uintptr_t)(CACHE_LINE_SIZE - 1);
+    expander.producerMessage = new ((void*)base) T();
+    expander.consumerMessage = new ((void*)(base + SLOT_SIZE)) T();
+  }
+};
+
+/*
+ * lock-free triple buffer that hands the latest copy of some engine state to
+ * the UI. the engine fills its own slot and publishes it by swapping it for
+ * the shared middle slot; the UI takes the middle slot in exchange for its own
+ * whenever a new copy has been published. neither side ever waits, and each
+ * slot is only touched by one thread at a time.
+ */
+template<typename T>
+struct SnapshotBuffer
+{
+  /* set alongside the middle slot's index while it holds an unread copy */
+  static const int FRESH_BIT = 4;
+
+  T slots[3] = {};
+  std::atomic<int> middle{ 1 };
+  int writeIndex = 0;
+  int readIndex = 2;
+
+  /* engine thread: fill the slot returned here, then call publish() */
+  T& getWriteSlot() { return slots[writeIndex]; }
+
+  void publish()
+  {
+    int old =
+      middle.exchange(writeIndex | FRESH_BIT, std::memory_order_acq_rel);
+    writeIndex = old & ~FRESH_BIT;
+  }
+
+  /* UI thread: the latest published copy, or a zeroed one before the first */
+  const T& read()
+  {
+    if (middle.load(std::memory_order_relaxed) & FRESH_BIT) {
+      int old = middle.exchange(readIndex, std::memory_order_acq_rel);
+      readIndex = old & ~FRESH_BIT;
+    }
+    return slots[readIndex];
+  }
+};
+
 struct EDModule : rack::Module
 {
+  /* samples between refreshes of knobs and other control-rate values */
+  static const int CONTROL_DIVISION = 16;
+  /* samples between snapshots published for the UI */
+  static const int SNAPSHOT_DIVISION = 256;
+
   /*
    * this should correspond to an index from THEME_COLORS,
    * or -1 to use the default theme
    */
   int panelTheme = -1;
+  rack::dsp::ClockDivider controlDivider;
+  rack::dsp::ClockDivider snapshotDivider;
+  /* seconds between control-rate refreshes */
+  float controlSampleTime = CONTROL_DIVISION / 44100.f;
+  /* forces a refresh on the next sample, e.g. after a sample rate change */
+  bool isControlRefreshDue = true;
+  /* bit n is set while input or output n has a cable; kept by onPortChange */
+  uint64_t connectedInputs = 0;
+  uint64_t connectedOutputs = 0;
+  /*
+   * set while the outputs last written would come out the same again, for as
+   * long as the params and connected inputs hold still
+   */
+  bool isSteady = false;
+  /* set while the inputs should be compared on the next sample */
+  bool isWatchingInputs = false;
+  /* whether this sample's params and inputs matched the copies below */
+  bool areInputsQuiet = false;
+  /* copies of the params and connected inputs, sized in onAdd() */
+  std::vector<float> steadyParams;
+  std::vector<int> steadyChannels;
+  std::vector<float> steadyVoltages;
+
+  EDModule();
+
+  /*
+   * call once per process(); returns true on samples where control-rate
+   * values should be refreshed
+   */
+  bool processControlRate();
+  /*
+   * call once per process(); returns true on samples where UI snapshots
+   * should be published
+   */
+  bool processSnapshotRate();
+  /*
+   * call first thing in process(); returns true while the module is steady
+   * and nothing it reads has changed, in which case process() can return and
+   * leave its outputs as they are. samples due for control-rate refreshes or
+   * snapshots are never skipped, so knobs, menus and lights still update.
+   */
+  bool processSteady();
+  /*
+   * compare each connected input, then the params, with its copy, refreshing
+   * the copy and stopping at the first that moved; returns true if none did
+   */
+  bool processInputChanges();
+  /*
+   * call at the end of a full process(), with whether the outputs would stay
+   * as written while the params and inputs hold still. the module only
+   * becomes steady on a sample whose params and inputs were found unchanged.
+   */
+  void setSteady(bool steady);
+  void onAdd(const AddEvent& e) override;
+  void onSampleRateChange(const SampleRateChangeEvent& e) override;
+  /* overrides must call this to keep the connection masks */
+  void onPortChange(const PortChangeEvent& e) override;
+  void onUnBypass(const UnBypassEvent& e) override;
+
+  bool isInputConnected(int input)
+  {
+    return (connectedInputs >> input) & 1;
+  }
+
+  bool isOutputConnected(int output)
+  {
+    return (connectedOutputs >> output) & 1;
+  }
+
+  /* set the channels of a connected output, if they differ */
+  void setOutputChannels(int output, int channels);
 
   virtual float getInputOrParamVal(int input, int param);
 
+  /*
+   * channel selects which voice of a polyphonic input to read; monophonic
+   * inputs are applied to every channel
+   */
   virtual float getInputOrParamVal(int input,
                                    int param,
                                    bool& isInputConnected,
-                                   bool useDisplayVal = false);
+                                   bool useDisplayVal = false,
+                                   int channel = 0);
 
   virtual rack::simd::float_4 getParamVal4(int param1st,
                                            bool useDisplayVal = false);
@@ -38,7 +225,8 @@ struct EDModule : rack::Module
   virtual rack::simd::float_4 getInputOrParamVal4(int input1st,
                                                   int param1st,
                                                   int& inputConnMask,
-                                                  bool useDisplayVal = false);
+                                                  bool useDisplayVal = false,
+                                                  int channel = 0);
   json_t* dataToJson(json_t* root);
   json_t* dataToJson() override;
   void dataFromJson(json_t* root) override;
@@ -61,4 +249,5 @@ extern rack::Plugin* pluginInstance;
 extern rack::Model* modelRonda;
 extern rack::Model* modelRondaEx;
 extern rack::Model* modelJab;
+extern rack::Model* modelJabQuad;
 extern rack::Model* modelAgate;
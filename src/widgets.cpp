@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cmath>
 #include <functional>
 #include <iomanip>
@@ -90,12 +91,34 @@ SolidRect::draw(const DrawArgs& args)
   nvgFill(args.vg);
 }
 
-std::vector<int>
+void
+PhaseRing::drawLayer(const DrawArgs& args, int layer)
+{
+  if (layer == 1 && phase >= 0.f) {
+    rack::Vec c = box.size.div(2);
+    float r = std::min(c.x, c.y) - strokeWidth / 2;
+    float a0 = -M_PI / 2;
+
+    nvgStrokeWidth(args.vg, strokeWidth);
+    nvgBeginPath(args.vg);
+    nvgCircle(args.vg, c.x, c.y, r);
+    nvgStrokeColor(args.vg, trackColor);
+    nvgStroke(args.vg);
+
+    nvgBeginPath(args.vg);
+    nvgArc(args.vg, c.x, c.y, r, a0, a0 + 2 * M_PI * phase, NVG_CW);
+    nvgStrokeColor(args.vg, color);
+    nvgStroke(args.vg);
+  }
+  rack::Widget::drawLayer(args, layer);
+}
+
+DotMatrixGridDisplay::CellCoords
 DotMatrixGridDisplay::pxToCellCoords(rack::Vec pos)
 {
   rack::Vec cell_size =
     rack::Vec(dotsPerCol * dotSize.x, dotsPerRow * dotSize.y);
-  std::vector<int> coords;
+  CellCoords coords = { -1, -1 };
   if (!(cell_size.x && cell_size.y)) {
     return coords;
   }
@@ -116,45 +139,78 @@ DotMatrixGridDisplay::pxToCellCoords(rack::Vec pos)
   return coords;
 }
 
+DotMatrixGridDisplay::CellState
+DotMatrixGridDisplay::getCell(int col, int row)
+{
+  return (CellState)cells[col * ROWS_MAX + row];
+}
+
+/* col and row must be within COLS_MAX and ROWS_MAX */
 void
-DotMatrixGridDisplay::draw(const DrawArgs& args)
+DotMatrixGridDisplay::setCell(int col, int row, CellState state)
+{
+  cells[col * ROWS_MAX + row] = state;
+  numCols = std::max(numCols, col + 1);
+  numRows = std::max(numRows, row + 1);
+}
+
+/* add a rect to the current path for each cell with all of the given states */
+void
+DotMatrixGridDisplay::addCellRects(NVGcontext* vg, int states)
 {
   float w = dotsPerCol * dotSize.x;
   float h = dotsPerRow * dotSize.y;
-  float x;
-  float y;
-  NVGcolor fill;
-  std::vector<int> cell;
   int total_dots_per_col = dotsPerCol + dotsBetweenCols;
   int total_dots_per_row = dotsPerRow + dotsBetweenRows;
 
-  for (const auto& p : cells) {
-    cell = p.first;
-    CellState state = p.second;
-    if (!(state & ENABLED)) {
-      continue;
+  for (int col = 0; col < numCols; col++) {
+    for (int row = 0; row < numRows; row++) {
+      if ((getCell(col, row) & states) == states) {
+        nvgRect(vg,
+                total_dots_per_col * dotSize.x * col,
+                total_dots_per_row * dotSize.y * row,
+                w,
+                h);
+      }
     }
-    x = total_dots_per_col * dotSize.x * cell.front();
-    y = total_dots_per_row * dotSize.y * cell.back();
-    fill = (state & PLAYING) ? playingColor : activeColor;
-    nvgBeginPath(args.vg);
-    nvgFillColor(args.vg, fill);
-    nvgRect(args.vg, x, y, w, h);
-    nvgFill(args.vg);
   }
+}
+
+/* enabled cells and dividers, in one path */
+void
+DotMatrixGridDisplay::draw(const DrawArgs& args)
+{
+  int total_dots_per_col = dotsPerCol + dotsBetweenCols;
 
+  nvgBeginPath(args.vg);
+  addCellRects(args.vg, ENABLED);
   for (unsigned int d = columnDividers, i = 1; d > 0; d >>= 1, i++) {
     if (d % 2) {
-      nvgBeginPath(args.vg);
-      nvgFillColor(args.vg, activeColor);
       nvgRect(args.vg,
               dotSize.x * ((total_dots_per_col)*i - (dotsBetweenCols / 2) - 1),
               dotSize.y,
               dotSize.x,
               box.size.y - (dotSize.y * 2));
-      nvgFill(args.vg);
     }
   }
+  nvgFillColor(args.vg, activeColor);
+  nvgFill(args.vg);
+}
+
+/*
+ * playing cells, drawn over the enabled ones every frame so that a parent
+ * framebuffer only needs redrawing when the pattern changes
+ */
+void
+DotMatrixGridDisplay::drawLayer(const DrawArgs& args, int layer)
+{
+  if (layer == 1) {
+    nvgBeginPath(args.vg);
+    addCellRects(args.vg, ENABLED | PLAYING);
+    nvgFillColor(args.vg, playingColor);
+    nvgFill(args.vg);
+  }
+  rack::OpaqueWidget::drawLayer(args, layer);
 }
 
 void
@@ -169,14 +225,9 @@ DotMatrixGridDisplay::onButton(const ButtonEvent& e)
 {
   OpaqueWidget::onButton(e);
   if (e.button == GLFW_MOUSE_BUTTON_LEFT && e.action == GLFW_PRESS) {
-    std::vector<int> cell_coords = pxToCellCoords(e.pos);
-    // if ((cell_coords.size() == 2) && pressCallback) {
+    CellCoords cell_coords = pxToCellCoords(e.pos);
     if (pressCallback) {
-      if (cell_coords.size() == 2) {
-        pressCallback(e, cell_coords.front(), cell_coords.back());
-      } else {
-        pressCallback(e, -1, -1);
-      }
+      pressCallback(e, cell_coords.col, cell_coords.row);
     }
   }
 }
@@ -187,13 +238,9 @@ DotMatrixGridDisplay::onDragHover(const DragHoverEvent& e)
   OpaqueWidget::onDragHover(e);
   if (e.origin == this && e.button == GLFW_MOUSE_BUTTON_LEFT &&
       (e.mouseDelta.x || e.mouseDelta.y)) {
-    std::vector<int> cell_coords = pxToCellCoords(e.pos);
+    CellCoords cell_coords = pxToCellCoords(e.pos);
     if (dragHoverCallback) {
-      if (cell_coords.size() == 2) {
-        dragHoverCallback(e, cell_coords.front(), cell_coords.back());
-      } else {
-        dragHoverCallback(e, -1, -1);
-      }
+      dragHoverCallback(e, cell_coords.col, cell_coords.row);
     }
   }
   e.consume(this);
@@ -62,6 +62,14 @@ public:
     PLAYING = 2,
     SELECTED = 4
   };
+  /* a cell's column and row, both -1 for no cell */
+  struct CellCoords
+  {
+    int col;
+    int row;
+  };
+  static const int COLS_MAX = 32;
+  static const int ROWS_MAX = 32;
   int dotsPerCol = 4;
   int dotsPerRow = 4;
   int dotsBetweenCols = 3;
@@ -70,15 +78,35 @@ public:
   NVGcolor activeColor = nvgRGB(0x86, 0x86, 0x86);
   NVGcolor playingColor = nvgRGB(0xFF, 0xFF, 0xFF);
   rack::Vec dotSize = rack::mm2px(rack::Vec(1.07083, 1.07083));
-  std::map<std::vector<int>, CellState> cells;
+  /* states of COLS_MAX * ROWS_MAX cells, column by column */
+  uint8_t cells[COLS_MAX * ROWS_MAX] = {};
+  /* extent of the cells ever set, which draw() walks */
+  int numCols = 0;
+  int numRows = 0;
   std::function<void(const ButtonEvent&, int, int)> pressCallback;
   std::function<void(const DragHoverEvent&, int, int)> dragHoverCallback;
 
-  std::vector<int> pxToCellCoords(rack::Vec pos);
+  CellCoords pxToCellCoords(rack::Vec pos);
+  CellState getCell(int col, int row);
+  void setCell(int col, int row, CellState state);
   void setBoxSizeInDots(float w, float h);
   void onButton(const ButtonEvent& e) override;
   void onDragHover(const DragHoverEvent& e) override;
+  void addCellRects(NVGcontext* vg, int states);
   void draw(const DrawArgs& args) override;
+  void drawLayer(const DrawArgs& args, int layer) override;
+};
+
+/* arc around a jack showing a 0-1 phase, clockwise from the top */
+struct PhaseRing : rack::TransparentWidget
+{
+  /* hidden while negative */
+  float phase = -1.f;
+  float strokeWidth = rack::mm2px(0.6);
+  NVGcolor color = nvgRGB(0xFF, 0xFF, 0xFF);
+  NVGcolor trackColor = nvgRGBA(0xFF, 0xFF, 0xFF, 0x20);
+
+  void drawLayer(const DrawArgs& args, int layer) override;
 };
 
 struct EDPanel : rack::SvgPanel
@@ -0,0 +1,87 @@
+/*
+ * checks the fastmath kernels against libm over the full CV range, -10 to
+ * 10 V. run with `make test-fastmath`; exits non-zero on the first kernel
+ * whose error is over its documented bound.
+ */
+#include "fastmath.hpp"
+#include <cstdio>
+
+using namespace rack;
+using namespace echodalia;
+
+static const double CV_MIN = -10.0;
+static const double CV_MAX = 10.0;
+static const double CV_STEP = 1e-5;
+
+static bool
+check(const char* name, double maxError, double bound)
+{
+  bool is_ok = maxError <= bound;
+  std::printf("%-10s max error %.3g, bound %.3g: %s\n",
+              name,
+              maxError,
+              bound,
+              is_ok ? "ok" : "FAIL");
+  return is_ok;
+}
+
+/* relative error of exp2 */
+static double
+testExp2()
+{
+  double max_error = 0;
+  for (double x = CV_MIN; x <= CV_MAX; x += CV_STEP) {
+    float xf = x;
+    double expected = std::exp2((double)xf);
+    double error =
+      std::fabs(fastmath::exp2(simd::float_4(xf))[0] / expected - 1);
+    max_error = std::max(max_error, error);
+  }
+  return max_error;
+}
+
+/* relative error of pow, less the part allowed for rounding its exponent */
+static double
+testPow(float base)
+{
+  double max_error = 0;
+  for (double x = CV_MIN; x <= CV_MAX; x += CV_STEP) {
+    float xf = x;
+    double expected = std::pow((double)base, (double)xf);
+    double error =
+      std::fabs(fastmath::pow(base, simd::float_4(xf))[0] / expected - 1) -
+      fastmath::POW_EXPONENT_ERROR * std::fabs(xf * std::log2(base));
+    max_error = std::max(max_error, error);
+  }
+  return max_error;
+}
+
+/* absolute error of posmod by 1, which must also stay below 1 */
+static double
+testPosmod()
+{
+  double max_error = 0;
+  for (double x = CV_MIN; x <= CV_MAX; x += CV_STEP) {
+    float xf = x;
+    float y = fastmath::posmod(simd::float_4(xf), 1.f)[0];
+    if (y < 0.f || y >= 1.f) {
+      return 1;
+    }
+    double expected = xf - std::floor((double)xf);
+    // 0 and 1 are the same phase
+    double error = std::fabs(y - expected);
+    max_error = std::max(max_error, std::min(error, 1 - error));
+  }
+  return max_error;
+}
+
+int
+main()
+{
+  fastmath::init();
+  bool is_ok = check("exp2", testExp2(), fastmath::EXP2_ERROR);
+  is_ok &= check("pow(9)", testPow(9.f), fastmath::EXP2_ERROR);
+  is_ok &= check("pow(32)", testPow(32.f), fastmath::EXP2_ERROR);
+  is_ok &= check("posmod", testPosmod(), fastmath::POSMOD_ERROR);
+  return is_ok ? 0 : 1;
+}